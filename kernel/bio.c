@@ -1,10 +1,22 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Each hash bucket has its own lock, so lookups of different
+// blocks on different CPUs don't contend. A buffer that is
+// recycled moves from its old bucket to the new block's;
+// bcache.lock serializes recycling, and the victim is the
+// least recently released unused buffer in any bucket.
+//
+// Buffers come from a slab cache. The cache starts with NBUF
+// buffers and grows on a miss, rather than evicting, while
+// free memory is above kalloc's low watermark. When memory
+// runs low, kalloc calls bshrink(), which frees least recently
+// used buffers, though never below NBUF.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
@@ -12,6 +24,12 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * bread_async and bwrite_async start the disk I/O and return
+//     without waiting, so that many requests can be in flight.
+//     Either call bwait before using or releasing the buffer,
+//     or pass a callback, which runs in the disk interrupt
+//     when the I/O is done and must release the buffer with
+//     bdone.
 
 
 #include "types.h"
@@ -23,69 +41,181 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 13
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;   // chain through buf.next
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock;   // serializes recycling, protects nbuf
+  struct kmem_cache *cache;
+  int nbuf;               // buffers allocated
+  struct bucket bucket[NBUCKET];
+  uint clock;             // stamps buf.lastuse; atomic
+  uint hits, misses;      // atomic
 } bcache;
 
+static int bshrink(int);
+
+static struct bucket*
+bbucket(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+// Allocate a new, unused buffer, or return 0 if out of memory.
+// Caller holds bcache.lock.
+static struct buf*
+bnew(void)
+{
+  struct buf *b;
+
+  if((b = kmem_cache_alloc(bcache.cache)) == 0)
+    return 0;
+  memset(b, 0, sizeof(*b));
+  initsleeplock(&b->lock, "buffer");
+  bcache.nbuf++;
+  return b;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+  bcache.cache = kmem_cache_create("buf", sizeof(struct buf));
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  // Start with NBUF buffers, all in one bucket; they
+  // spread out as they are recycled.
+  for(int i = 0; i < NBUF; i++){
+    if((b = bnew()) == 0)
+      panic("binit");
+    b->next = bcache.bucket[0].head;
+    bcache.bucket[0].head = b;
   }
+  kshrinker(bshrink);
+}
+
+// Look for block blockno on device dev in bucket bk,
+// which the caller has locked.
+static struct buf*
+blookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Find the least recently used unused buffer and take it
+// out of its bucket. If cold, only consider buffers that
+// brecycle() released. Caller holds bcache.lock.
+static struct buf*
+bvictim(int cold)
+{
+  struct bucket *bk, *best = 0;
+  struct buf *b, *victim = 0, **pp;
+
+  // hold the lock of the bucket with the best candidate
+  // so far, so that the candidate stays unused.
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    acquire(&bk->lock);
+    int found = 0;
+    for(b = bk->head; b; b = b->next){
+      if(b->refcnt == 0 && (!cold || b->lastuse == 0) &&
+         (victim == 0 || b->lastuse < victim->lastuse)){
+        victim = b;
+        found = 1;
+      }
+    }
+    if(found){
+      if(best)
+        release(&best->lock);
+      best = bk;
+    } else {
+      release(&bk->lock);
+    }
+  }
+  if(victim == 0)
+    return 0;
+
+  for(pp = &best->head; *pp != victim; pp = &(*pp)->next)
+    ;
+  *pp = victim->next;
+  release(&best->lock);
+  return victim;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// If ahead, the caller only wants a buffer to read the
+// block into, so return 0 if the block is cached.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ahead)
 {
+  struct bucket *bk = bbucket(dev, blockno);
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
+  // Is the block already cached? Check again, if not,
+  // once no one else can be recycling a buffer for it.
+  for(int pass = 0; pass < 2; pass++){
+    if(pass == 1)
+      acquire(&bcache.lock);
+    acquire(&bk->lock);
+    if((b = blookup(bk, dev, blockno)) != 0 && !ahead)
       b->refcnt++;
-      release(&bcache.lock);
+    release(&bk->lock);
+    if(b){
+      if(pass == 1)
+        release(&bcache.lock);
+      if(ahead)
+        return 0;
+      __sync_fetch_and_add(&bcache.hits, 1);
       acquiresleep(&b->lock);
       return b;
     }
   }
+  if(!ahead)
+    __sync_fetch_and_add(&bcache.misses, 1);
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
-  }
-  panic("bget: no buffers");
+  // Reuse a buffer that only held file data, or grow the
+  // cache if there's memory to spare, or else recycle the
+  // least recently used (LRU) unused buffer.
+  if((b = bvictim(1)) == 0 &&
+     (kmemlow() || (b = bnew()) == 0) &&
+     (b = bvictim(0)) == 0 && (b = bnew()) == 0)
+    panic("bget: no buffers");
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  acquire(&bk->lock);
+  b->next = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Queue disk I/O on the locked bufs bs[0..n-1] with the
+// elevator, which merges runs of consecutive blocks into
+// single requests, and get it going.
+static void
+bstart(struct buf **bs, int n, int write)
+{
+  for(int i = 0; i < n; i++)
+    elvadd(bs[i], write);
+  elvrun();
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,60 +224,250 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
     b->valid = 1;
+    b->done = 0;
+    bstart(&b, 1, 0);
+    virtio_disk_wait(b);
   }
   return b;
 }
 
+// Return a locked buf for the indicated block, filled with
+// zeroes rather than read from disk, for a caller that is
+// about to overwrite it.
+struct buf*
+bclear(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  memset(b->data, 0, BSIZE);
+  b->valid = 1;
+  return b;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  b->done = 0;
+  bstart(&b, 1, 1);
+  virtio_disk_wait(b);
+}
+
+// Start reading the n blocks in blocknos on device dev into
+// the cache, skipping those that are there already, without
+// waiting for the disk.
+void
+breadahead(uint dev, uint *blocknos, int n)
+{
+  struct buf *bs[RAMAX], *b;
+  int i, m;
+
+  for(i = m = 0; i < n && m < NELEM(bs); i++){
+    if((b = bget(dev, blocknos[i], 1)) == 0)
+      continue;
+    // no one else can look at the data until bdone().
+    b->valid = 1;
+    b->done = bdone;
+    bs[m++] = b;
+  }
+  bstart(bs, m, 0);
+}
+
+// Return locked bufs in bs[] with the contents of the n
+// blocks in blocknos on device dev, reading the ones that
+// aren't cached with as few disk requests as possible.
+void
+breadn(uint dev, uint *blocknos, int n, struct buf **bs)
+{
+  struct buf *rd[MAXSEG];
+  int i, m = 0;
+
+  for(i = 0; i < n; i++){
+    bs[i] = bget(dev, blocknos[i], 0);
+    if(!bs[i]->valid){
+      bs[i]->valid = 1;
+      bs[i]->done = 0;
+      rd[m++] = bs[i];
+    }
+    if(m == NELEM(rd) || (m > 0 && i == n-1)){
+      bstart(rd, m, 0);
+      m = 0;
+    }
+  }
+  for(i = 0; i < n; i++)
+    virtio_disk_wait(bs[i]);
+}
+
+// Return a locked buf for the indicated block, and start
+// reading it from the disk if it isn't cached. If done is
+// set, it is called with the buffer once the data is there,
+// perhaps before bread_async returns.
+struct buf*
+bread_async(uint dev, uint blockno, void (*done)(struct buf*))
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  b->done = done;
+  if(b->valid){
+    if(done)
+      done(b);
+    return b;
+  }
+  b->valid = 1;
+  bstart(&b, 1, 0);
+  return b;
+}
+
+// Start writing b's contents to disk.  Must be locked.
+void
+bwrite_async(struct buf *b, void (*done)(struct buf*))
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  b->done = done;
+  bstart(&b, 1, 1);
+}
+
+// Start writing the contents of the n locked bufs in bs[]
+// to disk, merging runs of consecutive blocks into single
+// requests. Call bwait on each before releasing it.
+void
+bwritev_async(struct buf **bs, int n)
+{
+  for(int i = 0; i < n; i++){
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwritev_async");
+    bs[i]->done = 0;
+  }
+  bstart(bs, n, 1);
+}
+
+// Wait for the disk to finish the I/O that bread_async
+// or bwrite_async started on b.  Must be locked.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  virtio_disk_wait(b);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Mark it the most recently used.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk = bbucket(b->dev, b->blockno);
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = __sync_add_and_fetch(&bcache.clock, 1);
+  }
+  release(&bk->lock);
+}
+
+// Release a buffer from a completion callback, which runs
+// in the disk interrupt rather than in the buffer's holder.
+void
+bdone(struct buf *b)
+{
+  struct bucket *bk = bbucket(b->dev, b->blockno);
+
+  releasesleep(&b->lock);
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  if (b->refcnt == 0)
+    b->lastuse = __sync_add_and_fetch(&bcache.clock, 1);
+  release(&bk->lock);
+}
+
+// Release a locked buffer, like brelse, but make it the
+// next to be recycled: its data is in the page cache, and
+// a scan through a file shouldn't push metadata out.
+void
+brecycle(struct buf *b)
+{
+  struct bucket *bk = bbucket(b->dev, b->blockno);
+
+  if(!holdingsleep(&b->lock))
+    panic("brecycle");
+
+  releasesleep(&b->lock);
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  if (b->refcnt == 0)
+    b->lastuse = 0;
+  release(&bk->lock);
+}
+
+// Free unused buffers beyond the first NBUF, about n pages'
+// worth, the ones brecycle() released first and then the
+// least recently used. Returns about how many pages that was;
+// the slab cache frees a page once all its buffers are free.
+// Called by kalloc() when free memory runs low.
+static int
+bshrink(int n)
+{
+  struct buf *b, *freed = 0;
+  uint64 want = ((uint64)n * PGSIZE + sizeof(*b) - 1) / sizeof(*b);
+  int nb;
+
+  acquire(&bcache.lock);
+  for(nb = 0; nb < want && bcache.nbuf > NBUF; nb++){
+    if((b = bvictim(1)) == 0 && (b = bvictim(0)) == 0)
+      break;
+    b->next = freed;
+    freed = b;
+    bcache.nbuf--;
   }
-  
   release(&bcache.lock);
+
+  for(; freed; freed = b){
+    b = freed->next;
+    kmem_cache_free(bcache.cache, freed);
+  }
+  return nb * sizeof(*b) / PGSIZE;
+}
+
+// Print buffer cache statistics, for procdump().
+void
+bstat(void)
+{
+  printf("bcache: %d buffers, %d hits, %d misses\n",
+         bcache.nbuf, bcache.hits, bcache.misses);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bbucket(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bbucket(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
-
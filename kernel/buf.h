@@ -1,12 +1,16 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  void (*done)(struct buf*); // called when the disk is done, or 0
+  struct buf *qnext; // elevator queue, then next buf in the same disk request
+  int write;   // queued to be written, not read?
+  uint64 deadline; // when the elevator must dispatch it, in r_time() units
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  uint lastuse; // when refcnt last fell to 0, for LRU
+  struct buf *next; // hash chain
   uchar data[BSIZE];
 };
 
@@ -2,26 +2,45 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct page;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct timer;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bclear(uint, uint);
 void            brelse(struct buf*);
+void            brecycle(struct buf*);
+void            breadahead(uint, uint*, int);
+void            breadn(uint, uint*, int, struct buf**);
+struct buf*     bread_async(uint, uint, void (*)(struct buf*));
+void            bwrite_async(struct buf*, void (*)(struct buf*));
+void            bwritev_async(struct buf**, int);
+void            bwait(struct buf*);
+void            bdone(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            bstat(void);
 
 // console.c
 void            consoleinit(void);
 void            consoleintr(int);
 void            consputc(int);
 
+// elevator.c
+void            elvinit(void);
+void            elvadd(struct buf*, int);
+void            elvrun(void);
+void            elvdone(int);
+
 // exec.c
 int             exec(char*, char**);
 
@@ -49,6 +68,7 @@ void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
+struct page*    ipage(struct inode*, uint);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
@@ -62,15 +82,39 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void*           kalloc_order(int);
+void            kfree_order(void *, int);
+void            krefinc(void *);
+int             krefcnt(void *);
+int             kmemlow(void);
+void            kshrinker(int (*)(int));
+int             kshrink(int);
 void            kinit(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_ordered(struct buf*);
+void            log_data(struct buf*);
+void            log_freed(uint);
+int             log_holds(uint);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+uint64          mmapbase(struct proc*);
+char*           mmappage(struct proc*, uint64, int, int*);
+void            mmapfree(struct proc*, pagetable_t);
+int             mmapcopy(struct proc*, struct proc*);
+
+// pcache.c
+void            pcinit(void);
+struct page*    pget(uint, uint, uint, int);
+void            pput(struct page*);
+void            pdrop(uint, uint);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -100,6 +144,9 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+int             kthread(char*, void (*)(void));
+int             sleep_timeout(void*, struct spinlock*, uint);
+int             sleep_until(void*, struct spinlock*, uint64);
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
@@ -133,6 +180,15 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// usercopy.S
+int             ucopy(void*, void*, uint64);
+int             ucopystr(char*, void*, uint64);
+
+// slab.c
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+
 // syscall.c
 void            argint(int, int*);
 int             argstr(int, char*, int);
@@ -141,12 +197,27 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// timer.c
+void            timerinit(void);
+void            settimer(struct timer*, uint64, void (*)(void*), void*);
+int             deltimer(struct timer*);
+void            timertick(uint64);
+void            hrsettimer(struct timer*, uint64, void (*)(void*), void*);
+int             hrdeltimer(struct timer*);
+uint64          hrtick(uint64);
+uint64          hrnext(void);
+uint64          timeridle(void);
+void            timerbusy(void);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            ipi(int);
+void            clockidle(void);
+void            clockbusy(void);
 
 // uart.c
 void            uartinit(void);
@@ -165,6 +236,13 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+uint64          vmfault(pagetable_t, uint64, int);
+void            uvmprefault(uint64, uint64, int);
+void            uvmswitch(struct proc*);
+void            kvmswitch(void);
+pagetable_t     ukvmcreate(pagetable_t);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -182,7 +260,9 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_start(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
+int             virtio_disk_poll(int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
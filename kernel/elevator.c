@@ -0,0 +1,178 @@
+// I/O scheduler for the disk.
+//
+// bio.c queues buffers here instead of handing them to the
+// driver directly. The queue holds pending reads and writes
+// in two lists, each sorted by block number, and keeps at
+// most ELVDEPTH requests at the disk at once, so that there
+// is a backlog to sort and merge:
+// * requests go out in ascending block order, sweeping up
+//     from the last block dispatched and wrapping around;
+// * each request takes a whole run of consecutive blocks of
+//     the same kind, up to MAXSEG, e.g. a commit's log blocks;
+// * reads are preferred to writes, but no more than
+//     WRITESTARVE read requests go ahead of waiting writes;
+// * a buffer that has waited past its deadline (READEXPIRE
+//     or WRITEEXPIRE) goes next, reads first.
+//
+// There is only one disk, so there is only one queue.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+
+#define ELVDEPTH    4         // requests at the disk at once
+#define WRITESTARVE 2         // read requests that may pass waiting writes
+#define READEXPIRE  (TIMEBASE/20)  // read deadline, in r_time() units (50 ms)
+#define WRITEEXPIRE (TIMEBASE/2)   // write deadline (500 ms)
+
+struct {
+  struct spinlock lock;
+  struct buf *reads;     // pending, sorted by blockno, through qnext
+  struct buf *writes;
+  int inflight;          // requests at the disk
+  uint pos;              // block after the last one dispatched
+  int starved;           // read requests dispatched while writes waited
+} elv;
+
+void
+elvinit(void)
+{
+  initlock(&elv.lock, "elevator");
+}
+
+// Queue the locked buf b to be read or written. The I/O
+// won't start until elvrun(). When it is done, the driver
+// calls b->done(b), if set, and wakes up virtio_disk_wait(b).
+void
+elvadd(struct buf *b, int write)
+{
+  struct buf **pp;
+
+  b->disk = 1;
+  b->write = write;
+  b->deadline = r_time() + (write ? WRITEEXPIRE : READEXPIRE);
+
+  acquire(&elv.lock);
+  pp = write ? &elv.writes : &elv.reads;
+  while(*pp && (*pp)->blockno < b->blockno)
+    pp = &(*pp)->qnext;
+  b->qnext = *pp;
+  *pp = b;
+  release(&elv.lock);
+}
+
+// The buf in list with the earliest deadline, if it has passed.
+static struct buf*
+expired(struct buf *list, uint64 now)
+{
+  struct buf *b, *oldest = 0;
+
+  for(b = list; b; b = b->qnext)
+    if(oldest == 0 || b->deadline < oldest->deadline)
+      oldest = b;
+  if(oldest && oldest->deadline <= now)
+    return oldest;
+  return 0;
+}
+
+// Choose the buf that the next request should include,
+// and set *listp to the list it is on.
+static struct buf*
+choose(struct buf ***listp)
+{
+  uint64 now = r_time();
+  struct buf *b;
+
+  if((b = expired(elv.reads, now)) != 0){
+    *listp = &elv.reads;
+    return b;
+  }
+  if((b = expired(elv.writes, now)) != 0){
+    *listp = &elv.writes;
+    return b;
+  }
+
+  if(elv.reads && (elv.writes == 0 || elv.starved < WRITESTARVE)){
+    if(elv.writes)
+      elv.starved++;
+    *listp = &elv.reads;
+  } else if(elv.writes){
+    elv.starved = 0;
+    *listp = &elv.writes;
+  } else {
+    return 0;
+  }
+
+  // continue the sweep, or start over from the lowest block.
+  for(b = **listp; b; b = b->qnext)
+    if(b->blockno >= elv.pos)
+      return b;
+  return **listp;
+}
+
+// Send the next request to the disk.
+// Returns 0 if there is nothing to send, or no room.
+// Caller holds elv.lock.
+static int
+dispatch(void)
+{
+  struct buf **list, **pp, **start, *b, *bs[MAXSEG];
+  int n;
+
+  if((b = choose(&list)) == 0)
+    return 0;
+
+  // back up to the start of b's run of consecutive blocks.
+  start = list;
+  for(pp = list; *pp != b; pp = &(*pp)->qnext)
+    if((*pp)->qnext->dev != (*pp)->dev || (*pp)->qnext->blockno != (*pp)->blockno + 1)
+      start = &(*pp)->qnext;
+
+  // take up to MAXSEG of the run.
+  n = 0;
+  for(b = *start; b && n < MAXSEG; b = b->qnext){
+    if(n > 0 && (b->dev != bs[n-1]->dev || b->blockno != bs[n-1]->blockno + 1))
+      break;
+    bs[n++] = b;
+  }
+  *start = b;
+
+  if(virtio_disk_start(bs, n, bs[0]->write) < 0){
+    // no descriptors free; put them back.
+    bs[n-1]->qnext = *start;
+    *start = bs[0];
+    return 0;
+  }
+  elv.inflight++;
+  elv.pos = bs[n-1]->blockno + 1;
+  return 1;
+}
+
+// Send queued requests to the disk, as many as it may have.
+void
+elvrun(void)
+{
+  acquire(&elv.lock);
+  while(elv.inflight < ELVDEPTH && dispatch())
+    ;
+  release(&elv.lock);
+}
+
+// The disk has finished n requests.
+// Called from the disk interrupt, or a polling waiter.
+void
+elvdone(int n)
+{
+  acquire(&elv.lock);
+  elv.inflight -= n;
+  if(elv.inflight < 0)
+    panic("elvdone");
+  while(elv.inflight < ELVDEPTH && dispatch())
+    ;
+  release(&elv.lock);
+}
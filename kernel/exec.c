@@ -8,6 +8,7 @@
 #include "elf.h"
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
+static int stackmap(pagetable_t, uint64, uint64 *);
 
 int flags2perm(int flags)
 {
@@ -24,11 +25,12 @@ exec(char *path, char **argv)
 {
   char *s, *last;
   int i, off;
-  uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
+  uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase, stackmapped;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
+  pagetable_t kpagetable = 0, oldkpagetable;
   struct proc *p = myproc();
 
   begin_op();
@@ -48,6 +50,8 @@ exec(char *path, char **argv)
 
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
+  if((kpagetable = ukvmcreate(pagetable)) == 0)
+    goto bad;
 
   // Load program into memory.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
@@ -59,6 +63,8 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
+    if(ph.vaddr + ph.memsz > USERTOP)
+      goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
     uint64 sz1;
@@ -75,17 +81,22 @@ exec(char *path, char **argv)
   p = myproc();
   uint64 oldsz = p->sz;
 
-  // Allocate some pages at the next page boundary.
+  // Reserve some pages at the next page boundary.
   // Make the first inaccessible as a stack guard.
-  // Use the rest as the user stack.
+  // Use the rest as the user stack; only the stack pages
+  // that hold the arguments are allocated now, the rest
+  // on first use.
   sz = PGROUNDUP(sz);
   uint64 sz1;
-  if((sz1 = uvmalloc(pagetable, sz, sz + (USERSTACK+1)*PGSIZE, PTE_W)) == 0)
+  if((sz1 = uvmalloc(pagetable, sz, sz + PGSIZE, PTE_W)) == 0)
+    goto bad;
+  uvmclear(pagetable, sz);
+  sz = sz1 + USERSTACK*PGSIZE;
+  if(sz > USERTOP)
     goto bad;
-  sz = sz1;
-  uvmclear(pagetable, sz-(USERSTACK+1)*PGSIZE);
   sp = sz;
   stackbase = sp - USERSTACK*PGSIZE;
+  stackmapped = sz;
 
   // Push argument strings, prepare rest of stack in ustack.
   for(argc = 0; argv[argc]; argc++) {
@@ -95,6 +106,8 @@ exec(char *path, char **argv)
     sp -= sp % 16; // riscv sp must be 16-byte aligned
     if(sp < stackbase)
       goto bad;
+    if(stackmap(pagetable, sp, &stackmapped) < 0)
+      goto bad;
     if(copyout(pagetable, sp, argv[argc], strlen(argv[argc]) + 1) < 0)
       goto bad;
     ustack[argc] = sp;
@@ -106,6 +119,8 @@ exec(char *path, char **argv)
   sp -= sp % 16;
   if(sp < stackbase)
     goto bad;
+  if(stackmap(pagetable, sp, &stackmapped) < 0)
+    goto bad;
   if(copyout(pagetable, sp, (char *)ustack, (argc+1)*sizeof(uint64)) < 0)
     goto bad;
 
@@ -122,15 +137,23 @@ exec(char *path, char **argv)
     
   // Commit to the user image.
   oldpagetable = p->pagetable;
+  oldkpagetable = p->kpagetable;
   p->pagetable = pagetable;
+  p->kpagetable = kpagetable;
+  p->asid = 0;  // the new page tables get a new ASID
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  uvmswitch(p);
+  kfree((void*)oldkpagetable);
+  mmapfree(p, oldpagetable);
   proc_freepagetable(oldpagetable, oldsz);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
+  if(kpagetable)
+    kfree((void*)kpagetable);
   if(pagetable)
     proc_freepagetable(pagetable, sz);
   if(ip){
@@ -164,3 +187,19 @@ loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz
   
   return 0;
 }
+
+// Make sure the stack pages from sp up to *mapped are
+// allocated, so that exec can copy the arguments there.
+// Returns 0 on success, -1 on failure.
+static int
+stackmap(pagetable_t pagetable, uint64 sp, uint64 *mapped)
+{
+  uint64 va = PGROUNDDOWN(sp);
+
+  if(va < *mapped){
+    if(uvmalloc(pagetable, va, *mapped, PTE_W) == 0)
+      return -1;
+    *mapped = va;
+  }
+  return 0;
+}
@@ -20,6 +20,9 @@ struct inode {
   int ref;            // Reference count
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint raoff;         // where a sequential readi() would continue
+  uint rawin;         // read-ahead window in blocks; 0 if not sequential
+  uint raend;         // block after the last one read ahead
 
   short type;         // copy of disk inode
   short major;
@@ -19,6 +19,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "page.h"
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -46,24 +47,28 @@ fsinit(int dev) {
   initlog(dev, &sb);
 }
 
-// Zero a block.
+// Zero a block, logging it, or for a file's data, writing it
+// before the transaction commits.
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int ordered)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  bp = bclear(dev, bno);
+  if(ordered)
+    log_ordered(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Allocate a zeroed disk block, for a file's data
+// if ordered, else for metadata or a directory.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, int ordered)
 {
   int b, bi, m;
   struct buf *bp;
@@ -74,10 +79,15 @@ balloc(uint dev)
     for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
       m = 1 << (bi % 8);
       if((bp->data[bi/8] & m) == 0){  // Is block free?
+        // data written outside the log mustn't go to a
+        // block that the log may yet overwrite, or that
+        // an uncommitted free left in another file.
+        if(ordered && log_holds(b + bi))
+          continue;
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
+        bzero(dev, b + bi, ordered);
         return b + bi;
       }
     }
@@ -102,6 +112,7 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  log_freed(b);
 }
 
 // Inodes.
@@ -271,6 +282,7 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->raoff = ip->rawin = ip->raend = 0;
   release(&itable.lock);
 
   return ip;
@@ -299,6 +311,7 @@ ilock(struct inode *ip)
     panic("ilock");
 
   acquiresleep(&ip->lock);
+  myproc()->nilock++;
 
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
@@ -323,6 +336,7 @@ iunlock(struct inode *ip)
   if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
     panic("iunlock");
 
+  myproc()->nilock--;
   releasesleep(&ip->lock);
 }
 
@@ -384,10 +398,11 @@ bmap(struct inode *ip, uint bn)
 {
   uint addr, *a;
   struct buf *bp;
+  int ordered = ip->type == T_FILE;
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, ordered);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
@@ -399,7 +414,7 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, 0);
       if(addr == 0)
         return 0;
       ip->addrs[NDIRECT] = addr;
@@ -407,7 +422,7 @@ bmap(struct inode *ip, uint bn)
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, ordered);
       if(addr){
         a[bn] = addr;
         log_write(bp);
@@ -450,6 +465,7 @@ itrunc(struct inode *ip)
 
   ip->size = 0;
   iupdate(ip);
+  pdrop(ip->dev, ip->inum);
 }
 
 // Copy stat information from inode.
@@ -464,6 +480,82 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Return page pn of inode ip from the page cache, reading
+// it in if necessary; bytes past the end of the file are
+// zero. Returns 0 if out of memory or disk space.
+// Caller must hold ip->lock, and must pput() the page.
+struct page*
+ipage(struct inode *ip, uint pn)
+{
+  struct page *pg;
+  struct buf *bp[PGSIZE/BSIZE];
+  uint addr[PGSIZE/BSIZE];
+  int i, n;
+
+  if((pg = pget(ip->dev, ip->inum, pn, 1)) == 0)
+    return 0;
+  if(pg->valid)
+    return pg;
+
+  // read the page's blocks at once, in one disk request
+  // if they are consecutive.
+  for(n = 0; n < NELEM(addr) && pn*PGSIZE + n*BSIZE < ip->size; n++){
+    if((addr[n] = bmap(ip, pn*PGSIZE/BSIZE + n)) == 0){
+      pput(pg);
+      return 0;
+    }
+  }
+  breadn(ip->dev, addr, n, bp);
+  for(i = 0; i < n; i++){
+    memmove(pg->data + i*BSIZE, bp[i]->data, BSIZE);
+    // the page cache has the data now.
+    brecycle(bp[i]);
+  }
+  memset(pg->data + n*BSIZE, 0, PGSIZE - n*BSIZE);
+  pg->valid = 1;
+  return pg;
+}
+
+// A readi() of n bytes at off is about to happen. If reads
+// of ip have been sequential, start reading the blocks after
+// these into the buffer cache without waiting for them. The
+// window of blocks read ahead doubles with each sequential
+// read, up to RAMAX, and closes when a read isn't sequential.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint bn, end, addr[RAMAX];
+  int na = 0;
+
+  if(off == ip->raoff)
+    ip->rawin = ip->rawin ? min(2*ip->rawin, RAMAX) : RAMIN;
+  else
+    ip->rawin = ip->raend = 0;
+  ip->raoff = off + n;
+  if(ip->rawin == 0)
+    return;
+
+  bn = (off + n + BSIZE - 1) / BSIZE;
+  if(bn < ip->raend)
+    bn = ip->raend;
+  end = min((off + n + BSIZE - 1) / BSIZE + ip->rawin, (ip->size + BSIZE - 1) / BSIZE);
+  for(; bn < end; bn++){
+    struct page *pg = pget(ip->dev, ip->inum, bn*BSIZE / PGSIZE, 0);
+    if(pg){
+      // already in the page cache.
+      pput(pg);
+      continue;
+    }
+    if((addr[na] = bmap(ip, bn)) == 0)
+      break;
+    na++;
+  }
+  ip->raend = bn;
+  // consecutive blocks go to the disk as one request.
+  breadahead(ip->dev, addr, na);
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -473,24 +565,38 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  struct page *pg;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
+  readahead(ip, off, n);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
-    if(addr == 0)
-      break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+    if((pg = ipage(ip, off/PGSIZE)) == 0){
+      // no page to spare, e.g. all are mapped: read
+      // the block through the buffer cache instead.
+      uint addr = bmap(ip, off/BSIZE);
+      if(addr == 0)
+        break;
+      bp = bread(ip->dev, addr);
+      m = min(n - tot, BSIZE - off%BSIZE);
+      if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+        brelse(bp);
+        tot = -1;
+        break;
+      }
       brelse(bp);
+      continue;
+    }
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if(either_copyout(user_dst, dst, pg->data + (off % PGSIZE), m) == -1) {
+      pput(pg);
       tot = -1;
       break;
     }
-    brelse(bp);
+    pput(pg);
   }
   return tot;
 }
@@ -507,6 +613,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  struct page *pg;
 
   if(off > ip->size || off + n < off)
     return -1;
@@ -523,7 +630,15 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
-    log_write(bp);
+    if(ip->type == T_FILE)
+      log_data(bp);
+    else
+      log_write(bp);
+    // keep a cached copy of the page up to date.
+    if((pg = pget(ip->dev, ip->inum, off/PGSIZE, 0)) != 0){
+      memmove(pg->data + (off % PGSIZE), bp->data + (off % BSIZE), m);
+      pput(pg);
+    }
     brelse(bp);
   }
 
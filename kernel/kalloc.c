@@ -1,6 +1,31 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers.
+//
+// Memory from end to PHYSTOP is managed by a binary buddy
+// allocator that hands out naturally aligned blocks of
+// 2^order pages, 0 <= order <= MAXORDER.  kalloc_order()
+// and kfree_order() use it directly, e.g. for contiguous
+// DMA buffers or 2 MiB (order 9) superpages.
+//
+// Single pages (kalloc()/kfree()) go through per-CPU free
+// lists so that the common path only touches that CPU's
+// lock.  Pages move between the per-CPU lists and the
+// buddy allocator KMEM_BATCH at a time; a CPU whose list
+// and the buddy allocator are both empty steals from
+// another CPU.
+//
+// Every allocated page has a reference count, so that
+// copy-on-write fork can share pages between processes.
+// kalloc() returns a page with one reference, krefinc()
+// adds one, and kfree() drops one and only frees the page
+// when the last reference goes away.
+//
+// Caches that can give memory back, like the buffer cache,
+// register a shrinker with kshrinker(). When free memory falls
+// below KMEM_LOW pages, kalloc() asks the shrinkers for enough
+// pages to get back to twice that, once per crossing of the
+// watermark, and again whenever it runs out.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +34,18 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KMEM_BATCH 32               // pages moved to/from the buddy allocator at once
+#define KMEM_HIGH  (2*KMEM_BATCH)   // drain a CPU list above this many pages
+
+#define KMEM_LOW   256              // low watermark, in free pages
+#define NSHRINKER  4
+
+#define MAXORDER   10               // largest buddy block is 2^MAXORDER pages
+#define NPAGES     ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PG(pa)  (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PG2PA(pg)  ((struct run*)(KERNBASE + (uint64)(pg) * PGSIZE))
+#define NOTFREE    0xff             // kmem.order[] of a page that heads no free block
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -16,27 +53,220 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev; // buddy free lists only
 };
 
-struct {
+struct kmem_cpu {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;
+};
+
+struct {
+  struct spinlock lock;             // protects free[], order[] and nfree
+  struct run free[MAXORDER+1];      // circular lists of free blocks, by order
+  uchar order[NPAGES];              // order of the free block starting at a page
+  int nfree;                        // free pages held by the buddy allocator
+  struct kmem_cpu cpu[NCPU];
+  int ref[NPAGES];                  // references to each allocated page; atomic
+  int (*shrinker[NSHRINKER])(int);
+  int nshrinker;
+  int low;                          // shrunk since falling below KMEM_LOW? atomic
 } kmem;
 
+static void buddy_free(void *pa, int k);
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  for(int k = 0; k <= MAXORDER; k++)
+    kmem.free[k].next = kmem.free[k].prev = &kmem.free[k];
+  memset(kmem.order, NOTFREE, sizeof(kmem.order));
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kmem_cpu");
   freerange(end, (void*)PHYSTOP);
 }
 
+// Hand [pa_start, pa_end) to the buddy allocator, in the
+// largest aligned blocks that fit.
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
+  int k;
+
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  acquire(&kmem.lock);
+  while(p + PGSIZE <= (char*)pa_end){
+    for(k = MAXORDER; k > 0; k--){
+      if(PA2PG(p) % (1L << k) == 0 && p + (PGSIZE << k) <= (char*)pa_end)
+        break;
+    }
+    buddy_free(p, k);
+    p += PGSIZE << k;
+  }
+  release(&kmem.lock);
+}
+
+static void
+buddy_push(int k, struct run *r)
+{
+  r->next = kmem.free[k].next;
+  r->prev = &kmem.free[k];
+  kmem.free[k].next->prev = r;
+  kmem.free[k].next = r;
+}
+
+static void
+buddy_remove(struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+}
+
+// Allocate a block of 2^k pages, splitting a larger
+// block if necessary.  Caller must hold kmem.lock.
+static void*
+buddy_alloc(int k)
+{
+  struct run *r, *b;
+  int j;
+
+  for(j = k; j <= MAXORDER; j++)
+    if(kmem.free[j].next != &kmem.free[j])
+      break;
+  if(j > MAXORDER)
+    return 0;
+
+  r = kmem.free[j].next;
+  buddy_remove(r);
+  kmem.order[PA2PG(r)] = NOTFREE;
+
+  // return the upper halves to the lower-order lists.
+  while(j > k){
+    j--;
+    b = (struct run*)((char*)r + (PGSIZE << j));
+    kmem.order[PA2PG(b)] = j;
+    buddy_push(j, b);
+  }
+  kmem.nfree -= 1 << k;
+  return r;
+}
+
+// Free a block of 2^k pages, merging it with its buddy
+// for as long as the buddy is free too.
+// Caller must hold kmem.lock.
+static void
+buddy_free(void *pa, int k)
+{
+  uint64 pg, bpg;
+
+  pg = PA2PG(pa);
+  if(kmem.order[pg] != NOTFREE)
+    panic("kfree: double free");
+  kmem.nfree += 1 << k;
+  for(; k < MAXORDER; k++){
+    bpg = pg ^ (1L << k);
+    if(bpg >= NPAGES || kmem.order[bpg] != k)
+      break;
+    buddy_remove(PG2PA(bpg));
+    kmem.order[bpg] = NOTFREE;
+    pg &= ~(1L << k);
+  }
+  kmem.order[pg] = k;
+  buddy_push(k, PG2PA(pg));
+}
+
+// Return every page on every CPU's list to the buddy
+// allocator, so that they can be merged into larger blocks.
+static void
+kmem_drain(void)
+{
+  struct kmem_cpu *kc;
+  struct run *r, *next;
+
+  for(kc = kmem.cpu; kc < &kmem.cpu[NCPU]; kc++){
+    acquire(&kc->lock);
+    r = kc->freelist;
+    kc->freelist = 0;
+    kc->nfree = 0;
+    release(&kc->lock);
+
+    acquire(&kmem.lock);
+    for(; r; r = next){
+      next = r->next;
+      buddy_free(r, 0);
+    }
+    release(&kmem.lock);
+  }
+}
+
+// Detach up to n pages from the front of *list.
+// Returns the detached chain and sets *got to its length.
+static struct run*
+takepages(struct run **list, int n, int *got)
+{
+  struct run *head, *tail;
+  int i;
+
+  head = *list;
+  if(head == 0){
+    *got = 0;
+    return 0;
+  }
+  tail = head;
+  for(i = 1; i < n && tail->next; i++)
+    tail = tail->next;
+  *list = tail->next;
+  tail->next = 0;
+  *got = i;
+  return head;
+}
+
+// Move a batch of pages from the buddy allocator, or failing
+// that from another CPU's list, into CPU id's list.
+// Returns the number of pages moved.
+static int
+refill(int id)
+{
+  struct kmem_cpu *kc;
+  struct run *chain, *tail, *r;
+  int n, i;
+
+  chain = tail = 0;
+  acquire(&kmem.lock);
+  for(n = 0; n < KMEM_BATCH; n++){
+    if((r = buddy_alloc(0)) == 0)
+      break;
+    r->next = chain;
+    chain = r;
+  }
+  release(&kmem.lock);
+
+  // steal half of the first non-empty list we find.
+  for(i = 1; chain == 0 && i < NCPU; i++){
+    kc = &kmem.cpu[(id + i) % NCPU];
+    acquire(&kc->lock);
+    if(kc->nfree > 0){
+      chain = takepages(&kc->freelist, (kc->nfree + 1) / 2, &n);
+      kc->nfree -= n;
+    }
+    release(&kc->lock);
+  }
+
+  if(chain == 0)
+    return 0;
+
+  kc = &kmem.cpu[id];
+  for(tail = chain; tail->next; tail = tail->next)
+    ;
+  acquire(&kc->lock);
+  tail->next = kc->freelist;
+  kc->freelist = chain;
+  kc->nfree += n;
+  release(&kc->lock);
+  return n;
 }
 
 // Free the page of physical memory pointed at by pa,
@@ -46,37 +276,226 @@ freerange(void *pa_start, void *pa_end)
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *chain, *next;
+  struct kmem_cpu *kc;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  n = __sync_sub_and_fetch(&kmem.ref[PA2PG(pa)], 1);
+  if(n < 0)
+    panic("kfree: ref");
+  if(n > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  kc = &kmem.cpu[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->nfree++;
+  chain = 0;
+  if(kc->nfree > KMEM_HIGH){
+    chain = takepages(&kc->freelist, KMEM_BATCH, &n);
+    kc->nfree -= n;
+  }
+  release(&kc->lock);
+  pop_off();
+
+  if(chain){
+    // give a batch back so that other CPUs can use it.
+    acquire(&kmem.lock);
+    for(r = chain; r; r = next){
+      next = r->next;
+      buddy_free(r, 0);
+    }
+    release(&kmem.lock);
+  }
 }
 
+// Register fn to be called when free memory runs low.
+// fn(n) should free about n pages, least recently used
+// first, and return how many it freed.
+// fn must not sleep or allocate memory.
+// Only called during boot, before other CPUs start.
+void
+kshrinker(int (*fn)(int))
+{
+  if(kmem.nshrinker >= NSHRINKER)
+    panic("kshrinker");
+  kmem.shrinker[kmem.nshrinker++] = fn;
+}
+
+// Ask the shrinkers for n pages, in the order they were
+// registered. Returns how many they freed.
+// Caller must hold no spinlocks.
+int
+kshrink(int n)
+{
+  int freed = 0;
+
+  for(int i = 0; i < kmem.nshrinker && freed < n; i++)
+    freed += kmem.shrinker[i](n - freed);
+  return freed;
+}
+
+// Free pages. Reads the counts without locks,
+// so only approximate.
+static int
+kfreecount(void)
+{
+  int n = kmem.nfree;
+
+  for(int i = 0; i < NCPU; i++)
+    n += kmem.cpu[i].nfree;
+  return n;
+}
+
+// Is free memory below the low watermark?
+int
+kmemlow(void)
+{
+  return kfreecount() < KMEM_LOW;
+}
+
+static void *kalloc1(void);
+
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
 void *
 kalloc(void)
+{
+  void *r;
+  int n;
+
+  r = kalloc1();
+  n = kfreecount();
+  if(n >= KMEM_LOW){
+    if(kmem.low)
+      kmem.low = 0;
+    return r;
+  }
+  // with interrupts on, the caller holds no spinlocks,
+  // so the shrinkers can safely take theirs. the first
+  // allocation below the watermark shrinks the caches;
+  // the ones after it don't, unless memory runs out.
+  if(intr_get() && (r == 0 || __sync_lock_test_and_set(&kmem.low, 1) == 0)){
+    kshrink(2*KMEM_LOW - n);
+    if(r == 0)
+      r = kalloc1();
+  }
+  return r;
+}
+
+static void *
+kalloc1(void)
 {
   struct run *r;
+  struct kmem_cpu *kc;
+  int id;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  kc = &kmem.cpu[id];
+  for(;;){
+    acquire(&kc->lock);
+    r = kc->freelist;
+    if(r){
+      kc->freelist = r->next;
+      kc->nfree--;
+    }
+    release(&kc->lock);
+    if(r || refill(id) == 0)
+      break;
+  }
+  pop_off();
 
-  if(r)
+  if(r){
     memset((char*)r, 5, PGSIZE); // fill with junk
+    kmem.ref[PA2PG(r)] = 1;
+  }
   return (void*)r;
 }
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size.
+// Returns a pointer that the kernel can use.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_order(int order)
+{
+  void *pa;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order > MAXORDER)
+    return 0;
+
+  acquire(&kmem.lock);
+  pa = buddy_alloc(order);
+  release(&kmem.lock);
+  if(pa == 0){
+    // the per-CPU lists may hold the missing buddies.
+    kmem_drain();
+    acquire(&kmem.lock);
+    pa = buddy_alloc(order);
+    release(&kmem.lock);
+  }
+
+  if(pa){
+    memset(pa, 5, PGSIZE << order); // fill with junk
+    for(int i = 0; i < (1 << order); i++)
+      kmem.ref[PA2PG(pa) + i] = 1;
+  }
+  return pa;
+}
+
+// Free 2^order pages at pa, which normally should have
+// been returned by kalloc_order(order).
+void
+kfree_order(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > MAXORDER || ((uint64)pa % (PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_order");
+
+  // the pages must not be shared.
+  for(int i = 0; i < (1 << order); i++)
+    if(__sync_sub_and_fetch(&kmem.ref[PA2PG(pa) + i], 1) != 0)
+      panic("kfree_order: ref");
+
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE << order);
+
+  acquire(&kmem.lock);
+  buddy_free(pa, order);
+  release(&kmem.lock);
+}
+
+// Add a reference to the allocated page at pa.
+void
+krefinc(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefinc");
+  if(__sync_fetch_and_add(&kmem.ref[PA2PG(pa)], 1) < 1)
+    panic("krefinc: free page");
+}
+
+// Return the number of references to the page at pa.
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&kmem.ref[PA2PG(pa)], __ATOMIC_SEQ_CST);
+}
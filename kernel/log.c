@@ -10,8 +10,8 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. A transaction is only committed once none of its FS
+// system calls are active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
@@ -19,22 +19,65 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the running transaction is committed.
+//
+// Commits are done by a kernel thread, committer(), which
+// closes the running transaction as soon as it has updates:
+// it keeps new FS system calls out until the ones in the
+// transaction finish, copies the transaction's blocks aside
+// into free log slots, and lets new system calls in again to
+// fill the next transaction in memory, while it writes the
+// copies to the log. So system calls that arrive during a
+// commit go into the same next transaction (group commit),
+// and end_op() doesn't wait for the disk.
+//
+// A second kernel thread, checkpointer(), writes committed
+// blocks to their home locations in the background, from the
+// slots' copies, and then frees the slots. Until then, the
+// blocks stay pinned in the cache, since the disk has old
+// contents. So a commit costs just the log writes and the
+// header write.
+//
+// File data goes into the log only when it overwrites an
+// existing block. A block newly allocated to a file is instead
+// written straight to its home location, just before the
+// transaction that allocated it commits (ordered mode; see
+// log_ordered()), so appends write their data once, and don't
+// take up log space.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
+//   header block, containing tail, n, and the home block #
+//     of each slot
+//   slot 0
+//   slot 1
 //   ...
-// Log appends are synchronous.
+// The slots are a circular buffer: the n committed but not
+// yet installed blocks are in the slots from tail on, in the
+// order they were committed.
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// Contents of the header block.
 struct logheader {
+  int tail;
+  int n;
+  int block[LOGBLOCKS];
+};
+
+#define NORDERED ((LOGSIZE/MAXOPBLOCKS)*MAXORDBLOCKS)
+
+// an FS op frees at most a whole file: its data blocks and
+// its indirect block.
+#define MAXFREEBLOCKS (MAXFILE+1)
+#define NFREED ((LOGSIZE/MAXOPBLOCKS)*MAXFREEBLOCKS)
+
+// Blocks logged by the running transaction.
+struct trans {
   int n;
   int block[LOGSIZE];
+  int nordered;           // data blocks to write before commit
+  int ordered[NORDERED];
+  int nfreed;             // blocks freed; see log_freed()
+  int freed[NFREED];
 };
 
 struct log {
@@ -42,43 +85,98 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int closing;     // committer() is closing the transaction, please wait.
   int dev;
-  struct logheader lh;
+  struct trans lh; // the running transaction
+  // slots are numbered from 0 up, forever; slot i is at
+  // log.start+1+i%nslot on disk.
+  int nslot;
+  uint64 tail;     // first committed slot that isn't installed
+  uint64 head;     // first slot that isn't written to the log
+  uint64 dtail;    // tail in the header on disk; slots before are free
+  uint64 dhead;    // head in the header on disk; slots before are committed
+  uint64 fhead;    // first slot that isn't frozen
+  int home[LOGBLOCKS];             // slot's home block #
+  struct buf *pinned[LOGBLOCKS];   // slot's block in the cache
+  struct buf slot[LOGBLOCKS];      // slot's contents
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void committer(void);
+static void checkpointer(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
+  if (sb->nlog > LOGBLOCKS || sb->nlog < LOGSIZE+1)
+    panic("initlog: bad log size");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.nslot = log.size - 1;
   log.dev = dev;
+  for (int i = 0; i < LOGBLOCKS; i++) {
+    initsleeplock(&log.slot[i].lock, "logslot");
+    log.slot[i].dev = dev;
+  }
   recover_from_log();
+  if (kthread("committer", committer) < 0 ||
+     kthread("checkpointer", checkpointer) < 0)
+    panic("initlog: kthread");
+}
+
+// Is block # b logged again in a slot in [i+1, end)?
+static int
+superseded(uint64 i, uint64 end)
+{
+  int b = log.home[i % log.nslot];
+
+  for (i++; i < end; i++)
+    if (log.home[i % log.nslot] == b)
+      return 1;
+  return 0;
 }
 
-// Copy committed blocks from log to their home location
+// Copy slots [from, to) to their home locations, the cached
+// blocks' copies if recovering, else the slots' own.
 static void
-install_trans(int recovering)
+install_trans(uint64 from, uint64 to, int recovering)
 {
-  int tail;
+  uint64 i;
+  int n = 0;
+  struct buf *dbuf[LOGBLOCKS];
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  // a block may be logged more than once; write the latest.
+  // start all the writes, then wait for them.
+  for (i = from; i < to; i++) {
+    int s = i % log.nslot;
+    if (superseded(i, to))
+      continue;
+    if (recovering) {
+      struct buf *lbuf = bread(log.dev, log.start+1+s); // read log block
+      dbuf[n] = bread(log.dev, log.home[s]); // read dst
+      memmove(dbuf[n]->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+    } else {
+      // the cached block may already hold the next
+      // transaction's changes, so write the slot.
+      acquiresleep(&log.slot[s].lock);
+      log.slot[s].blockno = log.home[s];
+      dbuf[n] = &log.slot[s];
+    }
+    n++;
+  }
+  bwritev_async(dbuf, n);  // write dst to disk
+  for (i = 0; i < n; i++) {
+    bwait(dbuf[i]);
+    if (recovering)
+      brelse(dbuf[i]);
+    else
+      releasesleep(&dbuf[i]->lock);
   }
 }
 
@@ -89,27 +187,46 @@ read_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  if (lh->tail < 0 || lh->tail >= log.nslot || lh->n < 0 || lh->n > log.nslot)
+    panic("read_head");
+  log.tail = log.dtail = lh->tail;
+  log.head = log.dhead = log.fhead = lh->tail + lh->n;
+  for (i = 0; i < log.nslot; i++) {
+    log.home[i] = lh->block[i];
   }
   brelse(buf);
 }
 
 // Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// This is the true point at which
+// transactions commit, and at which
+// installed ones' slots are freed.
 static void
 write_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
+  uint64 tail, head;
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+
+  // the header's lock orders concurrent write_head()s.
+  acquire(&log.lock);
+  tail = log.tail;
+  head = log.head;
+  hb->tail = tail % log.nslot;
+  hb->n = head - tail;
+  for (i = 0; i < log.nslot; i++) {
+    hb->block[i] = log.home[i];
   }
+  release(&log.lock);
   bwrite(buf);
+
+  acquire(&log.lock);
+  log.dtail = tail;
+  wakeup(&log.dtail);
+  log.dhead = head;
+  wakeup(&log.dhead);
+  release(&log.lock);
   brelse(buf);
 }
 
@@ -117,8 +234,8 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
+  install_trans(log.tail, log.head, 1); // if committed, copy from log to disk
+  log.tail = log.head;
   write_head(); // clear the log
 }
 
@@ -128,9 +245,11 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE ||
+              log.lh.nordered + (log.outstanding+1)*MAXORDBLOCKS > NORDERED ||
+              log.lh.nfreed + (log.outstanding+1)*MAXFREEBLOCKS > NFREED){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
@@ -142,69 +261,148 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// tells committer() if there is something to commit.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
-  }
+  if(log.outstanding < 0)
+    panic("end_op");
+  if(log.lh.n > 0 || log.lh.nordered > 0)
+    wakeup(&log.lh);
+  // begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Copy the running transaction's blocks into the slots
+// from log.head on. No FS system calls are active.
+static void
+freeze(void)
+{
+  int tail;
+
+  for (tail = 0; tail < log.lh.n; tail++) {
+    int s = (log.head + tail) % log.nslot;
+    struct buf *b = bread(log.dev, log.lh.block[tail]); // cache block
+    acquiresleep(&log.slot[s].lock);
+    memmove(log.slot[s].data, b->data, BSIZE);
+    log.slot[s].blockno = log.start+1+s;  // to write to the log
+    log.pinned[s] = b;  // log_write() pinned it
+    log.home[s] = log.lh.block[tail];
+    brelse(b);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Write the n frozen slots from log.head on to the log, and
+// the nord ordered data blocks home.
 static void
-write_log(void)
+write_log(int n, int *ordered, int nord)
 {
   int tail;
+  struct buf *to[LOGSIZE], *data[NORDERED];
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  // start all the writes, then wait for them.
+  for (tail = 0; tail < n; tail++)
+    to[tail] = &log.slot[(log.head + tail) % log.nslot];
+  bwritev_async(to, n);  // write the log, in large requests
+  for (tail = 0; tail < nord; tail++)
+    data[tail] = bread(log.dev, ordered[tail]);  // cached and pinned
+  bwritev_async(data, nord);
+  for (tail = 0; tail < n; tail++) {
+    bwait(to[tail]);
+    releasesleep(&to[tail]->lock);
+  }
+  for (tail = 0; tail < nord; tail++) {
+    bwait(data[tail]);
+    bunpin(data[tail]);
+    brelse(data[tail]);
   }
 }
 
+// The commit thread.
 static void
-commit()
+committer(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+  static int ordered[NORDERED];
+  int n, nord;
+
+  acquire(&log.lock);
+  for(;;){
+    while(log.lh.n == 0 && log.lh.nordered == 0)
+      sleep(&log.lh, &log.lock);
+
+    // close the transaction: let its system calls finish,
+    // but keep new ones out while freezing it.
+    log.closing = 1;
+    while(log.outstanding > 0)
+      sleep(&log.lh, &log.lock);
+
+    // wait for enough free slots; checkpointer()
+    // frees them.
+    while(log.head + log.lh.n - log.dtail > log.nslot)
+      sleep(&log.dtail, &log.lock);
+    release(&log.lock);
+
+    // no one else writes the slots from log.head on.
+    freeze();
+
+    acquire(&log.lock);
+    n = log.lh.n;
+    nord = log.lh.nordered;
+    memmove(ordered, log.lh.ordered, nord*sizeof(int));
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.lh.nordered = 0;
+    log.lh.nfreed = 0;
+    log.fhead = log.head + n;
+    log.closing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    write_log(n, ordered, nord); // Write the frozen blocks to the log, and data home
+    acquire(&log.lock);
+    log.head += n;
+    release(&log.lock);
+    write_head();    // Write header to disk -- the real commit
+
+    acquire(&log.lock);
+  }
+}
+
+// The checkpoint thread: installs committed slots.
+static void
+checkpointer(void)
+{
+  uint64 tail, head;
+
+  acquire(&log.lock);
+  for(;;){
+    while(log.tail == log.dhead)
+      sleep(&log.dhead, &log.lock);
+    tail = log.tail;
+    head = log.dhead;
+    release(&log.lock);
+
+    install_trans(tail, head, 0);
+    for (uint64 i = tail; i < head; i++)
+      bunpin(log.pinned[i % log.nslot]);
+
+    acquire(&log.lock);
+    log.tail = head;
+    release(&log.lock);
+    // free the slots for committer().
+    write_head();
+
+    acquire(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// committer() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,7 +415,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= LOGSIZE)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -234,3 +432,87 @@ log_write(struct buf *b)
   release(&log.lock);
 }
 
+
+// Caller has allocated data block b to a file, and zeroed it
+// in the cache. Rather than log it, write it, and later
+// changes to it in the same transaction, to its home
+// location just before the transaction commits, so that the
+// file never points to garbage. Pins b in the cache until then.
+// b must not be one that log_holds().
+void
+log_ordered(struct buf *b)
+{
+  int i;
+
+  acquire(&log.lock);
+  if (log.outstanding < 1)
+    panic("log_ordered outside of trans");
+  for (i = 0; i < log.lh.nordered; i++) {
+    if (log.lh.ordered[i] == b->blockno)
+      break;
+  }
+  if (i == log.lh.nordered) {
+    if (log.lh.nordered >= NORDERED)
+      panic("too many ordered blocks");
+    bpin(b);
+    log.lh.ordered[log.lh.nordered++] = b->blockno;
+  }
+  release(&log.lock);
+}
+
+// Caller has modified file data block b. Log it, unless it
+// was allocated in the running transaction, in which case
+// it goes straight home; see log_ordered().
+void
+log_data(struct buf *b)
+{
+  int i;
+
+  acquire(&log.lock);
+  for (i = 0; i < log.lh.nordered; i++) {
+    if (log.lh.ordered[i] == b->blockno) {
+      release(&log.lock);
+      return;
+    }
+  }
+  release(&log.lock);
+  log_write(b);
+}
+
+// Caller has freed block # b. Until the running transaction
+// commits, a crash leaves b in use by its old file, so
+// log_holds() keeps it from ordered data, which would go
+// home before the commit and show up in that file.
+void
+log_freed(uint b)
+{
+  acquire(&log.lock);
+  if (log.outstanding < 1)
+    panic("log_freed outside of trans");
+  if (log.lh.nfreed >= NFREED)
+    panic("too many freed blocks");
+  log.lh.freed[log.lh.nfreed++] = b;
+  release(&log.lock);
+}
+
+// Might recovery or checkpointing still write an old copy of
+// block # b from the log, or might a crash leave b in use by
+// the file that the running transaction freed it from? If so,
+// b must not be allocated for ordered data, which would be
+// overwritten, or be seen in the old file.
+int
+log_holds(uint b)
+{
+  uint64 i;
+  int r = 0;
+
+  acquire(&log.lock);
+  for (i = 0; i < log.lh.n && !r; i++)
+    r = log.lh.block[i] == b;
+  for (i = 0; i < log.lh.nfreed && !r; i++)
+    r = log.lh.freed[i] == b;
+  for (i = log.dtail; i < log.fhead && !r; i++)
+    r = log.home[i % log.nslot] == b;
+  release(&log.lock);
+  return r;
+}
@@ -21,12 +21,16 @@ main()
     kvminithart();   // turn on paging
     procinit();      // process table
     trapinit();      // trap vectors
+    timerinit();     // timer wheel
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    pcinit();        // file page cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    elvinit();       // disk I/O scheduler
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
@@ -25,6 +25,10 @@
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
 
+// core local interruptor (CLINT). writing 1 to a hart's msip
+// register sends it a machine-mode software interrupt.
+#define CLINT 0x2000000L
+
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
 #define PLIC_PRIORITY (PLIC + 0x0)
@@ -47,6 +51,11 @@
 // each surrounded by invalid guard pages.
 #define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
 
+// map the CLINT's msip registers beneath the kernel stacks,
+// since its physical address is below USERTOP.
+#define CLINTVA KSTACK(NPROC)
+#define CLINT_MSIP(hart) (CLINTVA + 4*(hart))
+
 // User memory layout.
 // Address zero first:
 //   text
@@ -57,3 +66,8 @@
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// user memory ends where the kernel's device mappings begin,
+// so that a process's kernel page table can map both;
+// see ukvmcreate() in vm.c.
+#define USERTOP PLIC
@@ -0,0 +1,286 @@
+//
+// Memory-mapped files: mmap() and munmap().
+//
+// Each mapping is a struct vma in p->vma[]. Mappings are
+// placed top-down below USERTOP, above the heap, and filled
+// in on demand: a page fault at an unmapped address in a
+// mapping maps that page of the file from the page cache
+// (see vmfault()). Shared mappings map the cached page
+// itself, so reads see what the process wrote; private
+// mappings map it copy-on-write.
+// Pages of a MAP_SHARED mapping that the process wrote to
+// are written back to the file when they are unmapped, by
+// munmap(), exit() or exec().
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "page.h"
+#include "fcntl.h"
+#include "memlayout.h"
+
+// Lowest address in use by p's mappings, or USERTOP
+// if there are none. The heap must stay below it.
+uint64
+mmapbase(struct proc *p)
+{
+  uint64 base = USERTOP;
+
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+static struct vma*
+findvma(struct proc *p, uint64 va)
+{
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// Find the page of a mapped file at va, for a page fault of
+// the given kind. Returns the page, with a reference for
+// the caller's page table, and sets *perm to the PTE
+// permissions it should be mapped with. Returns 0 if va
+// isn't mapped with the needed permissions or the file
+// can't be read right now.
+char*
+mmappage(struct proc *p, uint64 va, int read, int *perm)
+{
+  struct vma *v;
+  struct inode *ip;
+  struct page *pg;
+  char *mem;
+  int copied;
+
+  if((v = findvma(p, va)) == 0)
+    return 0;
+  if(read ? (v->prot & PROT_READ) == 0 : (v->prot & PROT_WRITE) == 0)
+    return 0;
+
+  // reading the file may sleep, which the caller must
+  // allow. it takes the inode's lock, so it mustn't while
+  // p holds any inode lock: a read() or write() copying
+  // to or from a mapping of another file, while another
+  // process does the reverse, would deadlock. so fileread()
+  // and filewrite() fault the user's pages in before they
+  // lock anything, and faults here under a lock are only
+  // for pages that couldn't be mapped then either.
+  ip = v->f->ip;
+  if(intr_get() == 0 || p->nilock > 0)
+    return 0;
+
+  ilock(ip);
+  if((pg = ipage(ip, (v->off + (va - v->addr)) / PGSIZE)) == 0){
+    iunlock(ip);
+    return 0;
+  }
+  copied = (v->flags & MAP_PRIVATE) && !read;
+  if(copied){
+    // a private page that is about to be written.
+    if((mem = kalloc()) != 0)
+      memmove(mem, pg->data, PGSIZE);
+  } else {
+    mem = pg->data;
+    krefinc(mem);
+  }
+  pput(pg);
+  iunlock(ip);
+  if(mem == 0)
+    return 0;
+
+  *perm = PTE_U;
+  if(v->prot & PROT_READ)
+    *perm |= PTE_R;
+  if(v->prot & PROT_WRITE){
+    *perm |= PTE_R;
+    if((v->flags & MAP_SHARED) || copied)
+      *perm |= PTE_W;
+    else
+      *perm |= PTE_COW;
+  }
+  if(v->prot & PROT_EXEC)
+    *perm |= PTE_X;
+  return mem;
+}
+
+// Write n bytes at kernel address src to ip at offset off,
+// in transactions small enough for the log, as filewrite()
+// does. Never writes past the end of the file.
+static void
+writeback(struct inode *ip, char *src, uint off, uint n)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint i, n1;
+
+  for(i = 0; i < n; i += n1){
+    n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+    begin_op();
+    ilock(ip);
+    if(off + i >= ip->size)
+      n1 = n - i;
+    else {
+      if(off + i + n1 > ip->size)
+        n1 = ip->size - (off + i);
+      writei(ip, 0, (uint64)src + i, off + i, n1);
+    }
+    iunlock(ip);
+    end_op();
+  }
+}
+
+// Unmap [start, end) of mapping v from pagetable, writing
+// dirty pages of a shared mapping back to the file.
+static void
+vmaunmap(pagetable_t pagetable, struct vma *v, uint64 start, uint64 end)
+{
+  pte_t *pte;
+
+  if((v->flags & MAP_SHARED) && (v->prot & PROT_WRITE)){
+    for(uint64 a = start; a < end; a += PGSIZE){
+      pte = walk(pagetable, a, 0);
+      if(pte && (*pte & PTE_V) && (*pte & PTE_D))
+        writeback(v->f->ip, (char*)PTE2PA(*pte), v->off + (a - v->addr), PGSIZE);
+    }
+  }
+  uvmunmap(pagetable, start, (end - start) / PGSIZE, 1);
+}
+
+// Remove all of p's mappings from pagetable, which is
+// p's page table or, during exec(), its old one.
+void
+mmapfree(struct proc *p, pagetable_t pagetable)
+{
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len){
+      vmaunmap(pagetable, v, v->addr, v->addr + v->len);
+      fileclose(v->f);
+      v->len = 0;
+    }
+  }
+}
+
+// Give the new child np copies of p's mappings. Pages that
+// are already there are shared: writable pages of private
+// mappings copy-on-write, those of shared mappings as they
+// are. Returns 0 on success, -1 on failure, having removed
+// what it did copy.
+int
+mmapcopy(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    if(v->len == 0)
+      continue;
+    if(uvmcopyrange(p->pagetable, np->pagetable, v->addr, v->len,
+                    v->flags & MAP_SHARED) < 0){
+      // the parent still holds each file, so fileclose()
+      // doesn't have to write or sleep.
+      for(nv = np->vma; nv < &np->vma[NVMA]; nv++){
+        if(nv->len){
+          uvmunmap(np->pagetable, nv->addr, nv->len / PGSIZE, 1);
+          fileclose(nv->f);
+          nv->len = 0;
+        }
+      }
+      return -1;
+    }
+    *nv = *v;
+    filedup(nv->f);
+  }
+  return 0;
+}
+
+// void *mmap(void *addr, uint len, int prot, int flags, int fd, uint off)
+// addr must be 0; the kernel chooses where to map.
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len, off;
+  int prot, flags, fd;
+  struct file *f;
+  struct proc *p = myproc();
+  struct vma *v, *free = 0;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(4, &fd);
+  argaddr(5, &off);
+  if(addr != 0 || len == 0 || len > USERTOP || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(fd < 0 || fd >= NOFILE || (f = p->ofile[fd]) == 0 || f->type != FD_INODE)
+    return -1;
+  if((prot & PROT_READ) && !f->readable)
+    return -1;
+  if((prot & PROT_WRITE) && flags == MAP_SHARED && !f->writable)
+    return -1;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len == 0){
+      free = v;
+      break;
+    }
+  if(free == 0)
+    return -1;
+
+  len = PGROUNDUP(len);
+  addr = mmapbase(p) - len;
+  if(addr > USERTOP || addr < PGROUNDUP(p->sz))
+    return -1;
+
+  free->addr = addr;
+  free->len = len;
+  free->prot = prot;
+  free->flags = flags;
+  free->off = off;
+  free->f = filedup(f);
+  return addr;
+}
+
+// int munmap(void *addr, uint len)
+// may remove the start, the end, or all of a mapping,
+// but not make a hole in it.
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len, end;
+  struct proc *p = myproc();
+  struct vma *v;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  end = PGROUNDUP(addr + len);
+  if(end < addr || (v = findvma(p, addr)) == 0 || end > v->addr + v->len)
+    return -1;
+  if(addr != v->addr && end != v->addr + v->len)
+    return -1;
+
+  vmaunmap(p->pagetable, v, addr, end);
+  if(addr == v->addr){
+    v->off += end - addr;
+    v->addr = end;
+  }
+  v->len -= end - addr;
+  if(v->len == 0)
+    fileclose(v->f);
+  return 0;
+}
@@ -0,0 +1,10 @@
+struct page {
+  int valid;   // has data been read from the file?
+  int used;    // referenced since the clock hand last passed?
+  uint dev;
+  uint inum;
+  uint pn;     // page number within the file
+  uint ref;    // holders that may read or write data
+  char *data;  // PGSIZE bytes from kalloc(), or 0
+  struct page *next; // hash chain
+};
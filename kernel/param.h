@@ -4,15 +4,23 @@
 #define NPROC        64  // maximum number of processes (speedsup bigfile)
 #endif
 #define NCPU          8  // maximum number of CPUs
+#define HZ           10  // clock ticks per second
+#define TIMEBASE 10000000  // r_time() counts per second (qemu virt)
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
+#define NVMA         16  // memory-mapped files per process
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define MAXORDBLOCKS 64  // max # of new data blocks an FS op writes, outside the log
+#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in a transaction
+#define LOGBLOCKS    (LOGSIZE*3)      // size of on-disk log, in blocks
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define MAXSEG       16   // max # of blocks in one disk request
+#define NPCACHE      512  // pages in the file page cache
+#define RAMIN        4    // initial read-ahead window, in blocks
+#define RAMAX        64   // maximum read-ahead window, in blocks
 #ifdef LAB_FS
 #define FSSIZE       200000  // size of file system in blocks
 #else
@@ -0,0 +1,201 @@
+// Page cache.
+//
+// The page cache holds the data of files in 4096-byte pages,
+// keyed by (device, inode number, page number). readi() reads
+// through it, writei() updates the pages that are present, and
+// mmap() maps its pages into user memory. The buffer cache then
+// only has to hold metadata and the blocks of transactions that
+// haven't been installed yet.
+//
+// Pages are reclaimed with the clock algorithm, independently
+// of the buffer cache's LRU list. Pages that are still mapped
+// by a process are never recycled, since the mapping and the
+// cache must share one copy; if every page is mapped, pget()
+// fails and readi() reads through the buffer cache. When free memory
+// runs low, kalloc calls pshrink(), which drops the pages that
+// the clock would recycle next.
+//
+// Interface:
+// * To get a page of a file, call pget; ipage in fs.c also
+//     fills it in from the disk.
+// * Call pput when done with the page.
+// * Callers must hold the inode's lock, which protects the
+//     contents of its pages.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "page.h"
+
+#define NPHASH 61
+
+struct {
+  struct spinlock lock;
+  struct page page[NPCACHE];
+  struct page *hash[NPHASH];
+  int hand;          // clock hand, an index into page[]
+} pcache;
+
+static struct page **
+pbucket(uint dev, uint inum, uint pn)
+{
+  return &pcache.hash[(dev * 31 + inum * 7 + pn) % NPHASH];
+}
+
+static void
+punhash(struct page *pg)
+{
+  struct page **pp;
+
+  for(pp = pbucket(pg->dev, pg->inum, pg->pn); *pp; pp = &(*pp)->next){
+    if(*pp == pg){
+      *pp = pg->next;
+      return;
+    }
+  }
+  panic("punhash");
+}
+
+static int pshrink(int);
+
+void
+pcinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  kshrinker(pshrink);
+}
+
+// Choose a page to recycle with the clock algorithm:
+// skip pages in use or mapped, and give recently used
+// pages a second chance. An empty slot will do if empty
+// is set. Returns 0 if there is none.
+static struct page*
+pvictim(int empty)
+{
+  struct page *pg;
+  int pass, i;
+
+  for(pass = 0; pass < 2; pass++){
+    for(i = 0; i < NPCACHE; i++){
+      pg = &pcache.page[pcache.hand];
+      pcache.hand = (pcache.hand + 1) % NPCACHE;
+      if(pg->ref)
+        continue;
+      if(pg->data == 0){
+        if(empty)
+          return pg;
+        continue;
+      }
+      if(krefcnt(pg->data) > 1)
+        continue;
+      if(pg->used){
+        pg->used = 0;
+        continue;
+      }
+      return pg;
+    }
+  }
+  return 0;
+}
+
+// Return page pn of inode inum on device dev, with a
+// reference held. If it isn't cached and alloc is set,
+// allocate an invalid page for the caller to fill in;
+// otherwise return 0. Also returns 0 if out of memory.
+struct page*
+pget(uint dev, uint inum, uint pn, int alloc)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+
+  for(pg = *pbucket(dev, inum, pn); pg; pg = pg->next){
+    if(pg->dev == dev && pg->inum == inum && pg->pn == pn){
+      pg->ref++;
+      pg->used = 1;
+      release(&pcache.lock);
+      return pg;
+    }
+  }
+
+  if(!alloc || (pg = pvictim(1)) == 0){
+    release(&pcache.lock);
+    return 0;
+  }
+  if(pg->data)
+    punhash(pg);
+  if(pg->data == 0 && (pg->data = kalloc()) == 0){
+    release(&pcache.lock);
+    return 0;
+  }
+  pg->dev = dev;
+  pg->inum = inum;
+  pg->pn = pn;
+  pg->valid = 0;
+  pg->used = 1;
+  pg->ref = 1;
+  pg->next = *pbucket(dev, inum, pn);
+  *pbucket(dev, inum, pn) = pg;
+  release(&pcache.lock);
+  return pg;
+}
+
+// Release a page from pget.
+// If the caller couldn't fill it in, it is discarded.
+void
+pput(struct page *pg)
+{
+  acquire(&pcache.lock);
+  if(pg->ref < 1)
+    panic("pput");
+  pg->ref--;
+  if(pg->ref == 0 && !pg->valid){
+    punhash(pg);
+    kfree(pg->data);
+    pg->data = 0;
+  }
+  release(&pcache.lock);
+}
+
+// Discard the cached pages of inode inum on device dev,
+// whose contents are going away. Processes that have
+// them mapped keep their own reference.
+void
+pdrop(uint dev, uint inum)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.page; pg < &pcache.page[NPCACHE]; pg++){
+    if(pg->data && pg->dev == dev && pg->inum == inum){
+      if(pg->ref)
+        panic("pdrop");
+      punhash(pg);
+      kfree(pg->data);
+      pg->data = 0;
+    }
+  }
+  release(&pcache.lock);
+}
+
+// Free up to n pages that no one is using or has mapped,
+// in clock order. Returns how many it freed.
+// Called by kalloc() when free memory runs low.
+static int
+pshrink(int n)
+{
+  struct page *pg;
+  int freed = 0;
+
+  acquire(&pcache.lock);
+  while(freed < n && (pg = pvictim(0)) != 0){
+    punhash(pg);
+    kfree(pg->data);
+    pg->data = 0;
+    freed++;
+  }
+  release(&pcache.lock);
+  return freed;
+}
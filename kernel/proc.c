@@ -15,7 +15,42 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// Each CPU has a queue of RUNNABLE processes, which it runs in
+// FIFO order. A process goes back on the queue of the CPU it
+// last ran on, for cache affinity; a new one goes on the
+// shortest queue. A CPU with an empty queue steals from the
+// longest one, and every BALANCETICKS ticks a CPU pulls a
+// process from the longest queue if it is longer than its own
+// by more than one.
+// A queued process's cpu and rqnext are protected by the
+// queue's lock. Acquire p->lock before a queue's lock, and
+// queues' locks in CPU order.
+// A CPU with nothing to run waits in wfi without clock ticks
+// (see clockidle()), so queueing a process sends an ipi() to
+// its CPU if that is idle, or else to an idle CPU to steal it.
+#define BALANCETICKS 10
+
+// A SLEEPING process is on the wait queue that its chan hashes
+// to, so that wakeup() looks only at processes that might be
+// waiting for it. Acquire a wait queue's lock before p->lock.
+#define NWAITQ 64
+
+static struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
+static struct runq {
+  struct spinlock lock;
+  struct proc *head;
+  struct proc *tail;
+  int n;
+} runq[NCPU];
+
+static void kick(int);
+
 extern void forkret(void);
+static void kthreadret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -51,6 +86,10 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -68,6 +107,145 @@ cpuid()
   return id;
 }
 
+// Append p to the tail of rq. Caller holds rq->lock.
+static void
+rqpush(struct runq *rq, struct proc *p)
+{
+  p->cpu = rq - runq;
+  p->rqnext = 0;
+  if(rq->tail)
+    rq->tail->rqnext = p;
+  else
+    rq->head = p;
+  rq->tail = p;
+  rq->n++;
+}
+
+// Take the process at the head of rq, or return 0.
+// Caller holds rq->lock.
+static struct proc*
+rqpop(struct runq *rq)
+{
+  struct proc *p;
+
+  if((p = rq->head) == 0)
+    return 0;
+  rq->head = p->rqnext;
+  if(rq->head == 0)
+    rq->tail = 0;
+  p->rqnext = 0;
+  rq->n--;
+  return p;
+}
+
+// Make p RUNNABLE and queue it, on the shortest queue if
+// it is new, else on the queue of the CPU it last ran on.
+// Caller holds p->lock.
+static void
+setrunnable(struct proc *p, int new)
+{
+  struct runq *rq;
+
+  if(new){
+    rq = &runq[0];
+    for(int i = 1; i < NCPU; i++)
+      if(runq[i].n < rq->n)
+        rq = &runq[i];
+  } else {
+    rq = &runq[p->cpu];
+  }
+  p->state = RUNNABLE;
+  acquire(&rq->lock);
+  rqpush(rq, p);
+  release(&rq->lock);
+  kick(rq - runq);
+}
+
+// A process was just queued on CPU i's queue. Wake CPU i if it
+// is idle, else some other idle CPU, which will steal it.
+// The fence pairs with the one in scheduler(): either we see
+// the CPU idle, or it sees the process before it waits.
+static void
+kick(int i)
+{
+  int me = cpuid();
+
+  __sync_synchronize();
+  if(i != me && cpus[i].idle){
+    if(__sync_lock_test_and_set(&cpus[i].idle, 0))
+      ipi(i);
+    return;
+  }
+  // we'll soon get to a lone process on our own queue.
+  if(i == me && runq[i].n <= 1)
+    return;
+  for(int j = 0; j < NCPU; j++){
+    if(j != me && cpus[j].idle && __sync_lock_test_and_set(&cpus[j].idle, 0)){
+      ipi(j);
+      return;
+    }
+  }
+}
+
+// The longest run queue other than mine, if it has at least
+// min processes. Reads the lengths without locks, so only
+// a hint.
+static struct runq*
+busiest(int me, int min)
+{
+  struct runq *rq = 0;
+
+  for(int i = 0; i < NCPU; i++)
+    if(i != me && runq[i].n >= min && (rq == 0 || runq[i].n > rq->n))
+      rq = &runq[i];
+  return rq;
+}
+
+// Move a process from the busiest queue to mine, if it is
+// longer than mine by more than one.
+static void
+balance(int me)
+{
+  struct runq *from, *to = &runq[me], *first, *second;
+  struct proc *p;
+
+  if((from = busiest(me, to->n + 2)) == 0)
+    return;
+  first = from < to ? from : to;
+  second = from < to ? to : from;
+  acquire(&first->lock);
+  acquire(&second->lock);
+  if(from->n > to->n + 1 && (p = rqpop(from)) != 0)
+    rqpush(to, p);
+  release(&second->lock);
+  release(&first->lock);
+}
+
+// Choose the next process for CPU me to run: from my queue,
+// else stolen from another CPU's. Returns 0 if there is none.
+static struct proc*
+pick(int me)
+{
+  struct runq *rq = &runq[me];
+  struct proc *p;
+
+  acquire(&rq->lock);
+  p = rqpop(rq);
+  release(&rq->lock);
+  if(p)
+    return p;
+
+  // idle: steal work from a busy CPU.
+  while((rq = busiest(me, 1)) != 0){
+    acquire(&rq->lock);
+    p = rqpop(rq);
+    release(&rq->lock);
+    if(p)
+      return p;
+  }
+  return 0;
+}
+
 // Return this CPU's cpu struct.
 // Interrupts must be disabled.
 struct cpu*
@@ -140,6 +318,14 @@ found:
     return 0;
   }
 
+  // The kernel page table to use on its behalf.
+  p->kpagetable = ukvmcreate(p->pagetable);
+  if(p->kpagetable == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+
   // Set up new context to start executing at forkret,
   // which returns to user space.
   memset(&p->context, 0, sizeof(p->context));
@@ -158,9 +344,13 @@ freeproc(struct proc *p)
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
+  if(p->kpagetable)
+    kfree((void*)p->kpagetable);
+  p->kpagetable = 0;
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  p->asid = 0;
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
@@ -249,12 +439,38 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p, 1);
 
   release(&p->lock);
 }
 
+// Start a kernel thread, a process with no user memory
+// that runs fn() in the kernel and never returns to user
+// space. fn must not return.
+// Returns the new thread's pid, or -1.
+int
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+  int pid;
+
+  if((p = allocproc()) == 0)
+    return -1;
+
+  // the trapframe is otherwise unused; keep fn there.
+  p->trapframe->a0 = (uint64)fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  setrunnable(p, 1);
+  pid = p->pid;
+
+  release(&p->lock);
+  return pid;
+}
+
 // Grow or shrink user memory by n bytes.
+// Growing only reserves the addresses; vmfault()
+// allocates each page when it is first used.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -264,9 +480,9 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n < sz || sz + n > mmapbase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
@@ -289,7 +505,7 @@ fork(void)
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0 || mmapcopy(p, np) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
@@ -319,7 +535,7 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np, 1);
   release(&np->lock);
 
   return pid;
@@ -351,6 +567,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Unmap memory-mapped files, writing back shared pages.
+  mmapfree(p, p->pagetable);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -446,6 +665,9 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int me = cpuid();
+  uint balanced = 0;
+  int tickless = 0;
 
   c->proc = 0;
   for(;;){
@@ -454,29 +676,55 @@ scheduler(void)
     // processes are waiting.
     intr_on();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-        found = 1;
+    if(ticks - balanced >= BALANCETICKS){
+      balance(me);
+      balanced = ticks;
+    }
+
+    if((p = pick(me)) == 0) {
+      // nothing to run; stop running on this core until an
+      // interrupt, without clock ticks until a timer is due.
+      // say we're idle first, so that kick() will interrupt
+      // us for a process queued after we last looked. wfi
+      // returns for a pending interrupt even with interrupts
+      // off, and the loop's intr_on() then takes it.
+      intr_off();
+      c->idle = 1;
+      __sync_synchronize();
+      if(runq[me].n == 0 && busiest(me, 1) == 0){
+        clockidle();
+        tickless = 1;
+        asm volatile("wfi");
       }
-      release(&p->lock);
+      c->idle = 0;
+      continue;
     }
-    if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
-      intr_on();
-      asm volatile("wfi");
+
+    // a queued process is ours once it is off the queue, but
+    // it may still be on its way off another CPU; wait for that
+    // CPU's scheduler to release it.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+    if(tickless){
+      clockbusy();
+      tickless = 0;
     }
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = me;
+    c->proc = p;
+    uvmswitch(p);
+    swtch(&c->context, &p->context);
+    kvmswitch();
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -513,7 +761,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p, 0);
   sched();
   release(&p->lock);
 }
@@ -542,26 +790,79 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's first scheduling swtches here.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  ((void (*)(void))p->trapframe->a0)();
+  panic("kthread returned");
+}
+
+// The wait queue for chan.
+static struct waitq*
+chanq(void *chan)
+{
+  uint64 h = (uint64)chan;
+
+  h ^= h >> 12;
+  h *= 0x9e3779b97f4a7c15L;
+  return &waitq[(h >> 32) % NWAITQ];
+}
+
+// Take p off wq. Caller holds wq->lock.
+static void
+wqremove(struct waitq *wq, struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = &wq->head; *pp; pp = &(*pp)->wqnext){
+    if(*pp == p){
+      *pp = p->wqnext;
+      p->wqnext = 0;
+      return;
+    }
+  }
+  panic("wqremove");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
-void
-sleep(void *chan, struct spinlock *lk)
+// If timed, don't sleep if the timer has gone off.
+static void
+sleep1(void *chan, struct spinlock *lk, int timed)
 {
   struct proc *p = myproc();
+  struct waitq *wq = chanq(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold the wait queue's lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks it),
   // so it's okay to release lk.
 
+  acquire(&wq->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
+  if(timed && p->timedout){
+    release(&p->lock);
+    release(&wq->lock);
+    acquire(lk);
+    return;
+  }
+
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->wqnext = wq->head;
+  wq->head = p;
+  release(&wq->lock);
 
   sched();
 
@@ -573,22 +874,123 @@ sleep(void *chan, struct spinlock *lk)
   acquire(lk);
 }
 
+void
+sleep(void *chan, struct spinlock *lk)
+{
+  sleep1(chan, lk, 0);
+}
+
+static void unsleep(struct proc*);
+
+// The timer for sleep_timeout() went off.
+// Called from the clock interrupt.
+static void
+timeout(void *arg)
+{
+  struct proc *p = arg;
+
+  acquire(&p->lock);
+  p->timedout = 1;
+  release(&p->lock);
+  unsleep(p);
+}
+
+// Like sleep(), but wake up after n ticks if nothing else
+// wakes us up before that.
+// Returns 0 if the time ran out, else 1.
+int
+sleep_timeout(void *chan, struct spinlock *lk, uint n)
+{
+  struct proc *p = myproc();
+  int r;
+
+  p->timedout = 0;
+  settimer(&p->timer, (uint64)ticks + n, timeout, p);
+  sleep1(chan, lk, 1);
+  deltimer(&p->timer);
+
+  acquire(&p->lock);
+  r = !p->timedout;
+  release(&p->lock);
+  return r;
+}
+
+// Like sleep_timeout(), but wake up when r_time() reaches
+// until, using a high-resolution timer.
+int
+sleep_until(void *chan, struct spinlock *lk, uint64 until)
+{
+  struct proc *p = myproc();
+  int r;
+
+  p->timedout = 0;
+  hrsettimer(&p->timer, until, timeout, p);
+  sleep1(chan, lk, 1);
+  hrdeltimer(&p->timer);
+
+  acquire(&p->lock);
+  r = !p->timedout;
+  release(&p->lock);
+  return r;
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
-
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
+  struct waitq *wq = chanq(chan);
+  struct proc *p, **pp;
+
+  acquire(&wq->lock);
+  for(pp = &wq->head; (p = *pp) != 0; ){
+    // p->chan doesn't change while p is on the queue.
+    if(p->chan == chan){
+      // p may still be on its way into sched().
       acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
+      *pp = p->wqnext;
+      p->wqnext = 0;
+      setrunnable(p, 0);
       release(&p->lock);
+    } else {
+      pp = &p->wqnext;
     }
   }
+  release(&wq->lock);
+}
+
+// Wake p if it is sleeping, whatever it is waiting for.
+// Must be called without any p->lock.
+static void
+unsleep(struct proc *p)
+{
+  struct waitq *wq;
+  void *chan;
+
+  for(;;){
+    acquire(&p->lock);
+    if(p->state != SLEEPING){
+      release(&p->lock);
+      return;
+    }
+    chan = p->chan;
+    release(&p->lock);
+
+    // the wait queue's lock comes first.
+    wq = chanq(chan);
+    acquire(&wq->lock);
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->chan == chan){
+      wqremove(wq, p);
+      setrunnable(p, 0);
+      release(&p->lock);
+      release(&wq->lock);
+      return;
+    }
+    // p woke up, and perhaps slept again, meanwhile.
+    release(&p->lock);
+    release(&wq->lock);
+  }
 }
 
 // Kill the process with the given pid.
@@ -603,11 +1005,9 @@ kill(int pid)
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
       release(&p->lock);
+      // Wake process from sleep().
+      unsleep(p);
       return 0;
     }
     release(&p->lock);
@@ -664,7 +1064,8 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
   }
 }
 
-// Print a process listing to console.  For debugging.
+// Print a process listing and buffer cache statistics to
+// console.  For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
 void
@@ -692,4 +1093,5 @@ procdump(void)
     printf("%d %s %s", p->pid, state, p->name);
     printf("\n");
   }
+  bstat();
 }
@@ -24,6 +24,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation of this hart's TLB entries; see vm.c
+  uint64 nexttick;            // r_time() of this hart's next clock tick
+  int idle;                   // Waiting in wfi for work? See scheduler().
 };
 
 extern struct cpu cpus[NCPU];
@@ -81,6 +84,25 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A timer; see timer.c.
+struct timer {
+  uint64 expires;              // Tick, or r_time() if high-resolution, at which to call fn
+  void (*fn)(void*);
+  void *arg;
+  struct timer *next;          // Next in the wheel slot
+  struct timer **pprev;        // What points to it, or 0 if not set
+};
+
+// A memory-mapped file; see mmap.c.
+struct vma {
+  uint64 addr;                 // First address, page-aligned
+  uint64 len;                  // Bytes, a multiple of PGSIZE; 0 if unused
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // Mapped file
+  uint64 off;                  // File offset of addr
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -91,6 +113,10 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // Run queue it is on, or last ran from
+  struct proc *rqnext;         // Next on the run queue; see proc.c
+  struct proc *wqnext;         // Next on chan's wait queue, if SLEEPING
+  int timedout;                // sleep_timeout()'s timer went off
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
@@ -99,9 +125,15 @@ struct proc {
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
+  pagetable_t kpagetable;      // Kernel page table, with the user memory in it
+  uint64 asid;                 // ASID of the page tables and its generation, or 0; see vm.c
+  int asidcpu;                 // Hart whose TLB is up to date for asid, or -1
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
+  struct timer timer;          // For sleep_timeout()
+  int nilock;                  // Inodes ilock()ed; see mmappage()
   struct file *ofile[NOFILE];  // Open files
+  struct vma vma[NVMA];        // Memory-mapped files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
 };
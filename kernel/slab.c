@@ -0,0 +1,210 @@
+// Slab allocator for small kernel objects.
+//
+// A cache hands out objects of one fixed size. Objects are
+// carved out of slabs, each a single page from kalloc() that
+// starts with a struct slab header, so the slab holding an
+// object is found by rounding its address down to a page.
+//
+// Each CPU keeps a magazine of objects in front of the slabs.
+// kmem_cache_alloc() and kmem_cache_free() only take the
+// cache lock when the magazine is empty or full, and then
+// move MAGSIZE/2 objects at a time.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NCACHE  16   // maximum number of caches
+#define MAGSIZE 16   // objects per per-CPU magazine
+
+struct object {
+  struct object *next;
+};
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;     // cache's partial or full list
+  struct slab *prev;
+  struct object *free;   // objects not handed out
+  int inuse;             // objects handed out, or sitting in a magazine
+};
+
+// objects start after the header.
+#define SLABHDR (((uint)sizeof(struct slab) + 15) & ~15)
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;             // object size, rounded up to 8 bytes
+  uint perslab;          // objects per slab
+  struct slab partial;   // slabs with at least one free object
+  struct slab full;      // slabs with no free objects
+  struct magazine mag[NCPU];
+};
+
+static struct kmem_cache caches[NCACHE];
+static int ncache;
+
+static void
+slab_remove(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+static void
+slab_push(struct slab *head, struct slab *s)
+{
+  s->next = head->next;
+  s->prev = head;
+  head->next->prev = s;
+  head->next = s;
+}
+
+// Create a cache of objects of the given size.
+// Only called during boot, before other CPUs start.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  if(ncache >= NCACHE)
+    panic("kmem_cache_create: too many caches");
+  if(size < sizeof(struct object))
+    size = sizeof(struct object);
+  size = (size + 7) & ~7;
+  if(size > PGSIZE - SLABHDR)
+    panic("kmem_cache_create: object too big");
+
+  c = &caches[ncache++];
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  c->partial.next = c->partial.prev = &c->partial;
+  c->full.next = c->full.prev = &c->full;
+  return c;
+}
+
+// Add a new slab to c's partial list.
+// Caller must hold c->lock.
+// Returns 0 on success, -1 if out of memory.
+static int
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  struct object *o;
+  int i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return -1;
+  s->cache = c;
+  s->free = 0;
+  s->inuse = 0;
+  for(i = c->perslab - 1; i >= 0; i--){
+    o = (struct object*)((char*)s + SLABHDR + i*c->size);
+    o->next = s->free;
+    s->free = o;
+  }
+  slab_push(&c->partial, s);
+  return 0;
+}
+
+// Take one object out of c's slabs, growing c if necessary.
+// Caller must hold c->lock.
+static void*
+slab_get(struct kmem_cache *c)
+{
+  struct slab *s;
+  struct object *o;
+
+  if(c->partial.next == &c->partial && slab_grow(c) < 0)
+    return 0;
+  s = c->partial.next;
+  o = s->free;
+  s->free = o->next;
+  s->inuse++;
+  if(s->free == 0){
+    slab_remove(s);
+    slab_push(&c->full, s);
+  }
+  return o;
+}
+
+// Return an object to its slab. A slab that becomes unused
+// goes back to kalloc, unless it is c's only partial slab.
+// Caller must hold c->lock.
+static void
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s;
+  struct object *o;
+
+  s = (struct slab*)PGROUNDDOWN((uint64)obj);
+  if(s->cache != c || s->inuse < 1)
+    panic("kmem_cache_free");
+  if(s->free == 0){
+    slab_remove(s);
+    slab_push(&c->partial, s);
+  }
+  o = (struct object*)obj;
+  o->next = s->free;
+  s->free = o;
+  s->inuse--;
+  if(s->inuse == 0 && (s->next != &c->partial || s->prev != &c->partial)){
+    slab_remove(s);
+    kfree((void*)s);
+  }
+}
+
+// Allocate an object from cache c.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    acquire(&c->lock);
+    while(m->n < MAGSIZE/2 && (obj = slab_get(c)) != 0)
+      m->obj[m->n++] = obj;
+    release(&c->lock);
+  }
+  obj = 0;
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+  return obj;
+}
+
+// Free an object that was returned by kmem_cache_alloc(c).
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  // Fill with junk to catch dangling refs.
+  memset(obj, 1, c->size);
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slab_put(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  pop_off();
+}
@@ -5,11 +5,18 @@
 #include "defs.h"
 
 void main();
-void timerinit();
+static void clockinit();
+static void ipiinit();
 
 // entry.S needs one stack per CPU.
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
+// a scratch area per CPU for machine-mode interrupts.
+uint64 mscratch0[NCPU][2];
+
+// in kernelvec.S, for machine-mode interrupts.
+void ipivec();
+
 // entry.S jumps here in machine mode on stack0.
 void
 start()
@@ -38,7 +45,10 @@ start()
   w_pmpcfg0(0xf);
 
   // ask for clock interrupts.
-  timerinit();
+  clockinit();
+
+  // let other harts interrupt this one.
+  ipiinit();
 
   // keep each CPU's hartid in its tp register, for cpuid().
   int id = r_mhartid();
@@ -49,8 +59,8 @@ start()
 }
 
 // ask each hart to generate timer interrupts.
-void
-timerinit()
+static void
+clockinit()
 {
   // enable supervisor-mode timer interrupts.
   w_mie(r_mie() | MIE_STIE);
@@ -62,5 +72,18 @@ timerinit()
   w_mcounteren(r_mcounteren() | 2);
   
   // ask for the very first timer interrupt.
-  w_stimecmp(r_time() + 1000000);
+  w_stimecmp(r_time() + TIMEBASE/HZ);
+}
+
+// take the machine-mode software interrupts that other harts
+// send with the CLINT, and pass them on to supervisor mode;
+// see ipivec in kernelvec.S.
+static void
+ipiinit()
+{
+  int id = r_mhartid();
+
+  w_mscratch((uint64)&mscratch0[id][0]);
+  w_mtvec((uint64)ipivec);
+  w_mie(r_mie() | MIE_MSIE);
 }
@@ -20,3 +20,9 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_mmap   22
+#define SYS_munmap 23
+#define SYS_iopoll 24
+#define SYS_clock_gettime 25
+#define SYS_nanosleep 26
+#define SYS_dropcaches 27
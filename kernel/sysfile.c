@@ -503,3 +503,22 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// turn polling for disk completions on (1) or off (0);
+// returns the old setting.
+uint64
+sys_iopoll(void)
+{
+  int on;
+
+  argint(0, &on);
+  return virtio_disk_poll(on);
+}
+
+// drop what the page and buffer caches can spare, so that
+// benchmarks can start cold; returns the pages freed.
+uint64
+sys_dropcaches(void)
+{
+  return kshrink(1 << 30);
+}
@@ -64,7 +64,8 @@ sys_sleep(void)
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    // no one wakes the process's own timer but the timer.
+    sleep_timeout(&myproc()->timer, &tickslock, n - (ticks - ticks0));
   }
   release(&tickslock);
   return 0;
@@ -79,6 +80,41 @@ sys_kill(void)
   return kill(pid);
 }
 
+// sleep for n nanoseconds, to the resolution of r_time()
+// rather than the clock tick.
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns, until;
+
+  argaddr(0, &ns);
+  until = r_time() + ns / (1000000000 / TIMEBASE);
+  acquire(&tickslock);
+  while(r_time() < until){
+    if(killed(myproc())){
+      release(&tickslock);
+      return -1;
+    }
+    // no one wakes the process's own timer but the timer.
+    sleep_until(&myproc()->timer, &tickslock, until);
+  }
+  release(&tickslock);
+  return 0;
+}
+
+// store the nanoseconds since boot, from r_time(), at addr.
+uint64
+sys_clock_gettime(void)
+{
+  uint64 addr, ns;
+
+  argaddr(0, &addr);
+  ns = r_time() * (1000000000 / TIMEBASE);
+  if(copyout(myproc()->pagetable, addr, (char*)&ns, sizeof(ns)) < 0)
+    return -1;
+  return 0;
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
@@ -0,0 +1,287 @@
+// Timers, kept in a hierarchical timing wheel.
+//
+// A timer calls fn(arg) from the clock interrupt once ticks
+// reaches its expiry time. The wheel has NLEVEL levels of
+// WHEELSIZE slots each. Level 0 has a slot for each of the next
+// WHEELSIZE ticks; each slot of level l covers WHEELSIZE^l
+// ticks. Every WHEELSIZE ticks, the timers in the next slot of
+// level 1 cascade down into level 0, and so on up, so that a
+// tick only looks at the timers that expire in it, plus now and
+// then one slot's worth from a higher level. Setting and
+// cancelling a timer take constant time.
+//
+// For finer times than a tick, a high-resolution timer expires
+// at an r_time() value instead. Each CPU keeps a sorted list of
+// the ones set on it, and sets stimecmp for the earlier of its
+// next tick and its first timer, so that the timer interrupt
+// comes just in time.
+//
+// An idle CPU doesn't tick; it asks for an interrupt only when
+// its first high-resolution timer expires. CPU 0 also wakes for
+// the wheel's timers, if no busy CPU's tick runs them first.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define WHEELBITS 6
+#define WHEELSIZE (1 << WHEELBITS)
+#define NLEVEL    4
+#define MAXDELAY  ((1L << (NLEVEL*WHEELBITS)) - 1)
+
+static struct {
+  struct spinlock lock;
+  uint64 now;                     // next tick to run
+  uint64 wake;                    // while CPU 0 idles, tick it wakes at; else 0
+  struct timer *slot[NLEVEL][WHEELSIZE];
+} wheel;
+
+static struct {
+  struct spinlock lock;
+  struct timer *list[NCPU];       // sorted by expires
+} hr;
+
+void
+timerinit(void)
+{
+  initlock(&wheel.lock, "timer");
+  initlock(&hr.lock, "hrtimer");
+}
+
+// Put t in the slot for its expiry time.
+// Caller holds wheel.lock.
+static void
+add(struct timer *t)
+{
+  uint64 when = t->expires;
+  struct timer **slot;
+  int l;
+
+  if(when < wheel.now)
+    when = wheel.now;  // late; run it on the next tick
+  if(when - wheel.now > MAXDELAY)
+    when = wheel.now + MAXDELAY;  // cascades down again later
+  for(l = 0; l < NLEVEL-1; l++)
+    if(when - wheel.now < (1L << ((l+1)*WHEELBITS)))
+      break;
+  slot = &wheel.slot[l][(when >> (l*WHEELBITS)) % WHEELSIZE];
+
+  t->next = *slot;
+  if(t->next)
+    t->next->pprev = &t->next;
+  t->pprev = slot;
+  *slot = t;
+}
+
+// Take t out of its wheel slot or high-resolution list.
+// Caller holds the lock for it.
+static void
+remove(struct timer *t)
+{
+  *t->pprev = t->next;
+  if(t->next)
+    t->next->pprev = t->pprev;
+  t->next = 0;
+  t->pprev = 0;
+}
+
+// Call fn(arg) from the clock interrupt at tick expires, or
+// on the next tick if that has passed. fn runs with timers
+// locked, so it must not sleep or set timers. If t is set
+// already, it is moved.
+void
+settimer(struct timer *t, uint64 expires, void (*fn)(void*), void *arg)
+{
+  acquire(&wheel.lock);
+  if(t->pprev)
+    remove(t);
+  t->expires = expires;
+  t->fn = fn;
+  t->arg = arg;
+  add(t);
+  // CPU 0 may be idle until a later tick.
+  if(wheel.wake && expires < wheel.wake){
+    wheel.wake = 0;
+    ipi(0);
+  }
+  release(&wheel.lock);
+}
+
+// Cancel t. Returns 1 if it was set, 0 if it had run or
+// was never set. Once deltimer() returns, t's fn isn't
+// running, and won't.
+int
+deltimer(struct timer *t)
+{
+  int r = 0;
+
+  acquire(&wheel.lock);
+  if(t->pprev){
+    remove(t);
+    r = 1;
+  }
+  release(&wheel.lock);
+  return r;
+}
+
+// Move the timers in slot i of level l down the wheel.
+// Returns i, so that the caller cascades the next level
+// too when it is 0.
+static int
+cascade(int l, int i)
+{
+  struct timer *t, *next;
+
+  t = wheel.slot[l][i];
+  wheel.slot[l][i] = 0;
+  for(; t; t = next){
+    next = t->next;
+    add(t);
+  }
+  return i;
+}
+
+// Run the timers that expire at or before tick now.
+// Called from the clock interrupt, on any CPU.
+void
+timertick(uint64 now)
+{
+  struct timer *t;
+  int i, l;
+
+  acquire(&wheel.lock);
+  while(wheel.now <= now){
+    i = wheel.now % WHEELSIZE;
+    for(l = 1; i == 0 && l < NLEVEL; l++)
+      i = cascade(l, (wheel.now >> (l*WHEELBITS)) % WHEELSIZE);
+    i = wheel.now % WHEELSIZE;
+    wheel.now++;
+    while((t = wheel.slot[0][i]) != 0){
+      remove(t);
+      t->fn(t->arg);
+    }
+  }
+  release(&wheel.lock);
+}
+
+// CPU 0 is going idle without ticks: return the tick by which
+// it must run the wheel again, or -1 if no timer is set. Timers
+// in higher levels are only known to the slot, so for them this
+// is the next cascade, up to WHEELSIZE ticks early. Until
+// timerbusy(), settimer() wakes CPU 0 for an earlier timer.
+uint64
+timeridle(void)
+{
+  uint64 t, next = -1;
+  int i, l;
+
+  acquire(&wheel.lock);
+  for(t = wheel.now; t < wheel.now + WHEELSIZE; t++){
+    if(wheel.slot[0][t % WHEELSIZE]){
+      next = t;
+      break;
+    }
+  }
+  for(l = 1; next == -1 && l < NLEVEL; l++){
+    for(i = 0; i < WHEELSIZE; i++){
+      if(wheel.slot[l][i]){
+        next = (wheel.now + WHEELSIZE - 1) & ~(uint64)(WHEELSIZE - 1);
+        break;
+      }
+    }
+  }
+  wheel.wake = next;
+  release(&wheel.lock);
+  return next;
+}
+
+// CPU 0 is ticking again.
+void
+timerbusy(void)
+{
+  acquire(&wheel.lock);
+  wheel.wake = 0;
+  release(&wheel.lock);
+}
+
+// Call fn(arg) from this CPU's timer interrupt once r_time()
+// reaches expires. Like settimer(), but to the limit of the
+// timebase rather than the tick. fn runs with high-resolution
+// timers locked, so it must not sleep or set timers. t must
+// not be set already.
+void
+hrsettimer(struct timer *t, uint64 expires, void (*fn)(void*), void *arg)
+{
+  struct timer **pp;
+
+  acquire(&hr.lock);
+  if(t->pprev)
+    panic("hrsettimer");
+  t->expires = expires;
+  t->fn = fn;
+  t->arg = arg;
+  for(pp = &hr.list[cpuid()]; *pp && (*pp)->expires <= expires; pp = &(*pp)->next)
+    ;
+  t->next = *pp;
+  if(t->next)
+    t->next->pprev = &t->next;
+  t->pprev = pp;
+  *pp = t;
+  // a one-shot interrupt for it, if it is due before the next.
+  if(expires < r_stimecmp())
+    w_stimecmp(expires);
+  release(&hr.lock);
+}
+
+// Cancel high-resolution timer t, which may be on any CPU.
+// Like deltimer().
+int
+hrdeltimer(struct timer *t)
+{
+  int r = 0;
+
+  acquire(&hr.lock);
+  if(t->pprev){
+    remove(t);
+    r = 1;
+  }
+  release(&hr.lock);
+  return r;
+}
+
+// Run this CPU's high-resolution timers that expire at or
+// before now. Returns when the next one expires, or -1.
+// Called from the timer interrupt.
+uint64
+hrtick(uint64 now)
+{
+  struct timer *t;
+  struct timer **list;
+  uint64 next;
+
+  acquire(&hr.lock);
+  list = &hr.list[cpuid()];
+  while((t = *list) != 0 && t->expires <= now){
+    remove(t);
+    t->fn(t->arg);
+  }
+  next = *list ? (*list)->expires : -1;
+  release(&hr.lock);
+  return next;
+}
+
+// When this CPU's first high-resolution timer expires, or -1.
+uint64
+hrnext(void)
+{
+  uint64 next;
+
+  acquire(&hr.lock);
+  next = hr.list[cpuid()] ? hr.list[cpuid()]->expires : -1;
+  release(&hr.lock);
+  return next;
+}
@@ -8,18 +8,31 @@
 
 struct spinlock tickslock;
 uint ticks;
+static uint64 tickdue;  // r_time() at which ticks next goes up
 
 extern char trampoline[], uservec[], userret[];
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
+// in usercopy.S: the instructions from start to end may take
+// page faults on user addresses, and continue at fixup if
+// vmfault() can't resolve them.
+struct exentry {
+  uint64 start;
+  uint64 end;
+  uint64 fixup;
+};
+extern struct exentry extable[], extable_end[];
+static uint64 exfixup(uint64);
+
 extern int devintr();
 
 void
 trapinit(void)
 {
   initlock(&tickslock, "time");
+  tickdue = r_time() + TIMEBASE/HZ;
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -67,6 +80,17 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 13 || r_scause() == 15){
+    // page fault: perhaps on a lazily-allocated, copy-on-write
+    // or memory-mapped page. reading a mapped file may sleep,
+    // so enable interrupts once done with the trap registers.
+    uint64 scause = r_scause(), stval = r_stval();
+    intr_on();
+    if(vmfault(p->pagetable, stval, scause == 13) == 0){
+      printf("usertrap(): page fault scause 0x%lx pid=%d\n", scause, p->pid);
+      printf("            sepc=0x%lx stval=0x%lx\n", p->trapframe->epc, stval);
+      setkilled(p);
+    }
   } else {
     printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
     printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
@@ -102,7 +126,7 @@ usertrapret(void)
 
   // set up trapframe values that uservec will need when
   // the process next traps into the kernel.
-  p->trapframe->kernel_satp = r_satp();         // kernel page table
+  p->trapframe->kernel_satp = r_satp();         // process's kernel page table
   p->trapframe->kernel_sp = p->kstack + PGSIZE; // process's kernel stack
   p->trapframe->kernel_trap = (uint64)usertrap;
   p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
@@ -114,13 +138,14 @@ usertrapret(void)
   unsigned long x = r_sstatus();
   x &= ~SSTATUS_SPP; // clear SPP to 0 for user mode
   x |= SSTATUS_SPIE; // enable interrupts in user mode
+  x &= ~SSTATUS_SUM; // in case another process was in usercopy.S
   w_sstatus(x);
 
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->pagetable, p->asid);
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -138,6 +163,7 @@ kerneltrap()
   uint64 sepc = r_sepc();
   uint64 sstatus = r_sstatus();
   uint64 scause = r_scause();
+  uint64 fixup;
   
   if((sstatus & SSTATUS_SPP) == 0)
     panic("kerneltrap: not from supervisor mode");
@@ -145,9 +171,15 @@ kerneltrap()
     panic("kerneltrap: interrupts enabled");
 
   if((which_dev = devintr()) == 0){
-    // interrupt or trap from an unknown source
-    printf("scause=0x%lx sepc=0x%lx stval=0x%lx\n", scause, r_sepc(), r_stval());
-    panic("kerneltrap");
+    if((scause == 13 || scause == 15) && (fixup = exfixup(sepc)) != 0){
+      // a page fault while copying to or from user memory.
+      if(vmfault(myproc()->pagetable, r_stval(), scause == 13) == 0)
+        sepc = fixup;
+    } else {
+      // interrupt or trap from an unknown source
+      printf("scause=0x%lx sepc=0x%lx stval=0x%lx\n", scause, r_sepc(), r_stval());
+      panic("kerneltrap");
+    }
   }
 
   // give up the CPU if this is a timer interrupt.
@@ -160,20 +192,105 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Return where to continue after a page fault at kernel
+// address pc, or 0 if the exception table doesn't cover it.
+static uint64
+exfixup(uint64 pc)
+{
+  struct exentry *e;
+
+  for(e = extable; e < extable_end; e++)
+    if(pc >= e->start && pc < e->end)
+      return e->fixup;
+  return 0;
+}
+
+// Bring ticks up to date with r_time() now, and run the timers
+// that are due. Any CPU that ticks does this, since an idle CPU
+// doesn't tick, and it may catch up several ticks at once.
+// Returns when the next tick is due.
+static uint64
+tick(uint64 now)
+{
+  uint64 n, due;
+  uint t = 0;
+
+  acquire(&tickslock);
+  if(now >= tickdue){
+    n = (now - tickdue) / (TIMEBASE/HZ) + 1;
+    ticks += n;
+    tickdue += n * (TIMEBASE/HZ);
+    t = ticks;
+  }
+  due = tickdue;
+  release(&tickslock);
+
+  // wake the processes whose time is up, and
+  // only those; see timer.c.
+  if(t)
+    timertick(t);
+  return due;
+}
+
 void
 clockintr()
 {
-  if(cpuid() == 0){
+  struct cpu *c = mycpu();
+  uint64 now = r_time(), next;
+
+  // the interrupt may be for a high-resolution timer
+  // rather than a tick.
+  if(now >= c->nexttick)
+    c->nexttick = tick(now);
+  next = hrtick(now);
+
+  // ask for the next timer interrupt. this also clears
+  // the interrupt request.
+  w_stimecmp(next < c->nexttick ? next : c->nexttick);
+}
+
+// This CPU has nothing to run. Rather than tick, ask for a timer
+// interrupt only when its next high-resolution timer expires,
+// and on CPU 0, when the wheel next has a timer to run.
+// Interrupts must be off.
+void
+clockidle(void)
+{
+  uint64 next = hrnext(), t, when;
+
+  if(cpuid() == 0 && (t = timeridle()) != -1){
     acquire(&tickslock);
-    ticks++;
-    wakeup(&ticks);
+    if(t <= ticks)
+      when = r_time();
+    else
+      when = tickdue + (t - ticks - 1) * (TIMEBASE/HZ);
     release(&tickslock);
+    if(when < next)
+      next = when;
   }
+  w_stimecmp(next);
+}
 
-  // ask for the next timer interrupt. this also clears
-  // the interrupt request. 1000000 is about a tenth
-  // of a second.
-  w_stimecmp(r_time() + 1000000);
+// This CPU has a process to run after clockidle(); tick again,
+// to preempt it. Interrupts must be off.
+void
+clockbusy(void)
+{
+  struct cpu *c = mycpu();
+  uint64 next = hrnext();
+
+  if(cpuid() == 0)
+    timerbusy();
+  w_stimecmp(next < c->nexttick ? next : c->nexttick);
+}
+
+// Interrupt CPU cpu, to wake it from wfi. The CPU's machine
+// mode turns this into a supervisor software interrupt; see
+// ipivec in kernelvec.S.
+void
+ipi(int cpu)
+{
+  *(volatile uint32*)CLINT_MSIP(cpu) = 1;
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -211,6 +328,11 @@ devintr()
     // timer interrupt.
     clockintr();
     return 2;
+  } else if(scause == 0x8000000000000001L){
+    // software interrupt from another CPU's ipi(), to
+    // wake this one. the scheduler will look for work.
+    w_sip(r_sip() & ~2);
+    return 1;
   } else {
     return 0;
   }
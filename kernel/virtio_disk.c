@@ -19,6 +19,10 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+// how long virtio_disk_wait() spins for a completion in
+// polling mode before it sleeps, in r_time() units (200 us).
+#define POLLTIME (TIMEBASE/5000)
+
 static struct disk {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
@@ -53,6 +57,10 @@ static struct disk {
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
+
+  int event_idx;   // negotiated VIRTIO_RING_F_EVENT_IDX?
+  int poll;        // should virtio_disk_wait() poll?
+  int polling;     // waiters polling right now
   
   struct spinlock vdisk_lock;
   
@@ -90,9 +98,9 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -196,12 +204,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +219,41 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// has the index moved from old to new past event? this is
+// vring_need_event() from the spec, Section 2.7.10.
+static int
+need_event(uint16 event, uint16 new, uint16 old)
+{
+  return (uint16)(new - event - 1) < (uint16)(new - old);
+}
+
+// hand bs[0..n-1], which hold consecutive blocks, to the
+// device as one request. if there are no free descriptors,
+// return -1.
+// caller holds disk.vdisk_lock.
+static int
+submit(struct buf **bs, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  if(n < 1 || n > MAXSEG)
+    panic("virtio_disk: request size");
+  for(int i = 1; i < n; i++){
+    if(bs[i]->blockno != bs[i-1]->blockno + 1)
+      panic("virtio_disk: not contiguous");
+  }
 
-  acquire(&disk.vdisk_lock);
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // one descriptor for type/reserved/sector, then descriptors
+  // for the data, here one per buf, then one for a 1-byte
+  // status result.
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
+  // allocate the descriptors.
+  int idx[MAXSEG+2];
+  if(allocn_desc(idx, n+2) < 0)
+    return -1;
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,27 +270,33 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 1; i <= n; i++){
+    disk.desc[idx[i]].addr = (uint64) bs[i-1]->data;
+    disk.desc[idx[i]].len = BSIZE;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
+
+  // record the struct bufs for virtio_disk_intr().
+  for(int i = 0; i < n; i++){
+    bs[i]->disk = 1;
+    bs[i]->qnext = i+1 < n ? bs[i+1] : 0;
+  }
+  disk.info[idx[0]].b = bs[0];
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  uint16 old = disk.avail->idx;
+  disk.avail->ring[old % NUM] = idx[0];
 
   __sync_synchronize();
 
@@ -278,22 +305,153 @@ virtio_disk_rw(struct buf *b, int write)
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  // with EVENT_IDX, the device says in avail_event which entry
+  // it wants to hear about; if it is still working through
+  // earlier ones, it will find this one without a notify.
+  if(!disk.event_idx || need_event(disk.used->avail_event, disk.avail->idx, old))
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  return 0;
+}
+
+// Start reading or writing bs[0..n-1], which must hold
+// consecutive blocks, as one request, without waiting for
+// the disk. When the disk is done, the interrupt or a polling
+// waiter calls b->done(b) for each buf that has it set, wakes up
+// virtio_disk_wait(b), and tells the elevator.
+// Returns -1, without starting, if the queue is full.
+// Only the elevator calls this; see elevator.c.
+int
+virtio_disk_start(struct buf **bs, int n, int write)
+{
+  int r;
+
+  acquire(&disk.vdisk_lock);
+  r = submit(bs, n, write);
+  release(&disk.vdisk_lock);
+  return r;
+}
+
+// finish the requests the device has put on the used ring.
+// returns how many there were, for elvdone().
+// caller holds disk.vdisk_lock.
+static int
+reap(void)
+{
+  int n = 0;
+
+  // the device increments disk.used->idx when it
+  // adds an entry to the used ring.
+
+again:
+  while(disk.used_idx != *(volatile uint16 *)&disk.used->idx){
+    __sync_synchronize();
+    int id = disk.used->ring[disk.used_idx % NUM].id;
+
+    if(disk.info[id].status != 0)
+      panic("virtio_disk: status");
+
+    struct buf *b = disk.info[id].b, *next;
+    disk.info[id].b = 0;
+    free_chain(id);
+    for(; b; b = next){
+      void (*done)(struct buf*) = b->done;
+      next = b->qnext;
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+      if(done)
+        done(b);   // must not sleep or start disk I/O
+    }
+
+    disk.used_idx += 1;
+    n++;
+  }
+
+  // with EVENT_IDX, ask for an interrupt when the next request
+  // finishes, unless a waiter is polling, in which case ask
+  // for none. then look again, since the device may have
+  // finished one before it saw used_event.
+  if(disk.polling){
+    disk.avail->used_event = disk.used_idx - 1;
+  } else {
+    disk.avail->used_event = disk.used_idx;
+    __sync_synchronize();
+    if(disk.used_idx != *(volatile uint16 *)&disk.used->idx)
+      goto again;
+  }
+
+  return n;
+}
+
+// spin until the disk is done with b, or for POLLTIME,
+// finishing whatever requests complete meanwhile, so that
+// a fast request costs neither an interrupt nor a sleep.
+// caller holds disk.vdisk_lock.
+static void
+poll(struct buf *b)
+{
+  uint64 end = r_time() + POLLTIME;
+  int n;
+
+  disk.polling++;
+  disk.avail->used_event = disk.used_idx - 1;
+  while(b->disk == 1 && r_time() < end){
+    // don't hold the lock while spinning, so others can
+    // start requests.
+    release(&disk.vdisk_lock);
+    while(*(volatile uint16 *)&disk.used->idx == disk.used_idx && r_time() < end)
+      ;
+    acquire(&disk.vdisk_lock);
+    if((n = reap()) > 0){
+      release(&disk.vdisk_lock);
+      elvdone(n);
+      acquire(&disk.vdisk_lock);
+    }
+  }
+  disk.polling--;
+
+  // re-enable interrupts, and catch anything that finished
+  // before the device saw that.
+  if((n = reap()) > 0){
+    release(&disk.vdisk_lock);
+    elvdone(n);
+    acquire(&disk.vdisk_lock);
   }
+}
+
+// Turn polling for completions on or off.
+// Returns the old setting.
+int
+virtio_disk_poll(int on)
+{
+  int old;
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  acquire(&disk.vdisk_lock);
+  old = disk.poll;
+  disk.poll = on != 0;
+  release(&disk.vdisk_lock);
+  return old;
+}
 
+// Wait for the disk to finish with b. In polling mode,
+// spin for a while first.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  if(disk.poll && b->disk == 1)
+    poll(b);
+  while(b->disk == 1) {
+    sleep(b, &disk.vdisk_lock);
+  }
   release(&disk.vdisk_lock);
 }
 
 void
 virtio_disk_intr()
 {
+  int n;
+
   acquire(&disk.vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
@@ -306,22 +464,11 @@ virtio_disk_intr()
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
-  }
+  n = reap();
 
   release(&disk.vdisk_lock);
+
+  // let the elevator send more requests.
+  if(n > 0)
+    elvdone(n);
 }
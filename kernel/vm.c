@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -15,6 +17,45 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+#define SUPERORDER 9  // kalloc_order() of a superpage
+
+// Per-process kernel page tables.
+//
+// While the kernel runs on behalf of a process it uses the
+// process's own kernel page table, p->kpagetable: a copy of
+// the kernel's root page whose first entry is shared with
+// the user page table, so that user memory (below USERTOP)
+// appears at its user addresses. copyin() and copyout()
+// then access it directly with sstatus.SUM set.
+//
+// Address-space identifiers.
+//
+// A process's two page tables run with its own ASID, so the
+// TLB keeps user entries across traps; ASID 0 is the
+// kernel_pagetable's. ASIDs are handed out in order and never
+// reused within a generation. When they run out a new
+// generation starts, and each hart flushes its whole TLB
+// before it next runs a process with an ASID of the new
+// generation.
+//
+// A hart may still hold entries for a process's ASID from
+// an earlier run. p->asidcpu names the one hart whose
+// entries are known to be current; any other hart flushes
+// the ASID before running p. Changing p's page table in a
+// way that removes or restricts mappings flushes the ASID
+// on the current hart.
+#define ASIDMASK 0xffff
+
+struct {
+  struct spinlock lock;
+  uint64 gen;     // current generation, above the ASID bits
+  uint64 next;    // next unused ASID of this generation
+} asids;
+
+static int asidbits;  // ASID bits that the hardware implements
+
+static pte_t *walklevel(pagetable_t, uint64, int, int);
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -37,6 +78,7 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // mappages() uses superpages for most of it.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -45,6 +87,9 @@ kvmmake(void)
 
   // allocate and map a kernel stack for each process.
   proc_mapstacks(kpgtbl);
+
+  // the CLINT's msip registers, to interrupt other harts.
+  kvmmap(kpgtbl, CLINTVA, CLINT, PGSIZE, PTE_R | PTE_W);
   
   return kpgtbl;
 }
@@ -54,6 +99,9 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  initlock(&asids.lock, "asids");
+  asids.gen = ASIDMASK + 1;
+  asids.next = 1;
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -61,15 +109,127 @@ kvminit(void)
 void
 kvminithart()
 {
+  uint64 asid;
+
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  // find out how many ASID bits are implemented: the
+  // others read back as zero.
+  w_satp(MAKE_SATP(kernel_pagetable, ASIDMASK));
+  asid = (r_satp() >> 44) & ASIDMASK;
+  for(asidbits = 0; asid & (1L << asidbits); asidbits++)
+    ;
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Switch this hart to p's kernel page table, before the
+// kernel runs on p's behalf. Gives p an ASID of the current
+// generation if it doesn't have one, and flushes whatever
+// stale TLB entries this hart may hold for it.
+void
+uvmswitch(struct proc *p)
+{
+  struct cpu *c;
+  uint64 gen;
+  int id;
+
+  push_off();
+  c = mycpu();
+  id = cpuid();
+
+  if(asidbits == 0){
+    // no ASIDs: all processes share ASID 0.
+    w_satp(MAKE_SATP(p->kpagetable, 0));
+    sfence_vma();
+    pop_off();
+    return;
+  }
+
+  gen = __atomic_load_n(&asids.gen, __ATOMIC_ACQUIRE);
+  if((p->asid & ~ASIDMASK) != gen){
+    acquire(&asids.lock);
+    if(asids.next >= (1L << asidbits)){
+      asids.gen += ASIDMASK + 1;
+      asids.next = 1;
+    }
+    gen = asids.gen;
+    p->asid = gen | asids.next++;
+    p->asidcpu = id;  // no hart holds entries for a new ASID
+    release(&asids.lock);
+  }
+
+  w_satp(MAKE_SATP(p->kpagetable, p->asid));
+  if(c->asidgen != gen){
+    // entries of the old generation may use any ASID.
+    sfence_vma();
+    c->asidgen = gen;
+  } else if(p->asidcpu != id){
+    sfence_vma_asid(p->asid & ASIDMASK);
+  }
+  p->asidcpu = id;
+  pop_off();
+}
+
+// Switch this hart back to the kernel's own page table.
+// It agrees with every process's kernel page table except
+// for user memory, which the scheduler doesn't touch.
+void
+kvmswitch(void)
+{
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
+}
+
+// Make a kernel page table for the process whose user page
+// table is pagetable: the same as kernel_pagetable, except
+// that the first 1 GB, which holds the user memory and the
+// kernel's device mappings (see uvmcreate()), comes from
+// pagetable.
+// Returns 0 if out of memory.
+pagetable_t
+ukvmcreate(pagetable_t pagetable)
+{
+  pagetable_t kpagetable;
+
+  if((kpagetable = (pagetable_t)kalloc()) == 0)
+    return 0;
+  memmove(kpagetable, kernel_pagetable, PGSIZE);
+  kpagetable[0] = pagetable[0];
+  return kpagetable;
+}
+
+// Mappings in pagetable were removed or lost permissions.
+// If it is the current process's page table, the kernel
+// may be using it too, so flush this hart's entries now.
+// Other harts flush the ASID before they run p.
+static void
+uvmstale(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable){
+    push_off();
+    sfence_vma_asid(p->asid & ASIDMASK);
+    p->asidcpu = cpuid();
+    pop_off();
+  }
+}
+
+// The current process's PTE for va was just made valid or
+// pointed at a new page. Flush this hart's entry for va;
+// other harts flush the whole ASID before they run p.
+static void
+uvmfresh(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable)
+    sfence_vma_page(va, p->asid & ASIDMASK);
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -82,15 +242,29 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A level-1 PTE can itself be a leaf that maps a 2 MiB
+// superpage; xv6 marks such PTEs with PTE_S. If va lies
+// in a superpage, walk returns its level-1 PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but stop at the PTE for va at the given
+// level, 0 or 1.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(*pte & PTE_S)
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -99,7 +273,37 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(level, va)];
+}
+
+// Physical address of the page holding va, which is
+// mapped by the leaf PTE pte.
+static uint64
+pteaddr(pte_t pte, uint64 va)
+{
+  if(pte & PTE_S)
+    return PTE2PA(pte) + (PGROUNDDOWN(va) & (SUPERPGSIZE - 1));
+  return PTE2PA(pte);
+}
+
+// Replace the superpage mapped by the level-1 PTE *pte
+// with a level-0 page-table page that maps the same
+// memory as 512 pages with the same permissions.
+// Returns 0 on success, -1 if out of memory.
+static int
+demote(pte_t *pte)
+{
+  pagetable_t pagetable;
+  uint64 pa, flags;
+
+  if((pagetable = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte) & ~PTE_S;
+  for(int i = 0; i < 512; i++)
+    pagetable[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pagetable) | PTE_V;
+  return 0;
 }
 
 // Look up a virtual address, return the physical address,
@@ -121,7 +325,9 @@ walkaddr(pagetable_t pagetable, uint64 va)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  if((*pte & (PTE_R|PTE_X)) == 0)
+    return 0;  // a guard page; see uvmclear()
+  pa = pteaddr(*pte, va);
   return pa;
 }
 
@@ -138,6 +344,9 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa.
 // va and size MUST be page-aligned.
+// Wherever va and pa are both 2 MiB-aligned and at least
+// 2 MiB remain, a single superpage PTE is used, unless
+// there is already a level-0 page-table page for the range.
 // Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
@@ -158,6 +367,19 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = va;
   last = va + size - PGSIZE;
   for(;;){
+    if(a % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 &&
+       last - a >= SUPERPGSIZE - PGSIZE){
+      if((pte = walklevel(pagetable, a, 1, 1)) == 0)
+        return -1;
+      if((*pte & PTE_V) == 0){
+        *pte = PA2PTE(pa) | perm | PTE_S | PTE_V;
+        if(last - a == SUPERPGSIZE - PGSIZE)
+          break;
+        a += SUPERPGSIZE;
+        pa += SUPERPGSIZE;
+        continue;
+      }
+    }
     if((pte = walk(pagetable, a, 1)) == 0)
       return -1;
     if(*pte & PTE_V)
@@ -172,22 +394,37 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never mapped, because
+// they are allocated lazily, are skipped. A superpage
+// that is only partly unmapped is demoted first.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end;
   pte_t *pte;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
+    if(*pte & PTE_S){
+      if(a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= end){
+        if(do_free)
+          kfree_order((void*)PTE2PA(*pte), SUPERORDER);
+        *pte = 0;
+        a += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      if(demote(pte) != 0)
+        panic("uvmunmap: demote");
+      pte = walk(pagetable, a, 0);
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -196,18 +433,30 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     }
     *pte = 0;
   }
+  uvmstale(pagetable);
 }
 
 // create an empty user page table.
+// its page for the first 1 GB also holds the kernel's
+// device mappings above USERTOP, without PTE_U, so that
+// the process's kernel page table can share that page
+// (see ukvmcreate()).
 // returns 0 if out of memory.
 pagetable_t
 uvmcreate()
 {
-  pagetable_t pagetable;
+  pagetable_t pagetable, low;
   pagetable = (pagetable_t) kalloc();
   if(pagetable == 0)
     return 0;
   memset(pagetable, 0, PGSIZE);
+  low = (pagetable_t) kalloc();
+  if(low == 0){
+    kfree(pagetable);
+    return 0;
+  }
+  memmove(low, (void*)PTE2PA(kernel_pagetable[0]), PGSIZE);
+  pagetable[0] = PA2PTE(low) | PTE_V;
   return pagetable;
 }
 
@@ -228,7 +477,9 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 }
 
 // Allocate PTEs and physical memory to grow process from oldsz to
-// newsz, which need not be page aligned.  Returns new size or 0 on error.
+// newsz, which need not be page aligned.  Each 2 MiB-aligned
+// 2 MiB of the range gets a superpage if one is free.
+// Returns new size or 0 on error.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 {
@@ -240,6 +491,17 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
+    if(a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= newsz &&
+       (mem = kalloc_order(SUPERORDER)) != 0){
+      memset(mem, 0, SUPERPGSIZE);
+      if(mappages(pagetable, a, SUPERPGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
+        kfree_order(mem, SUPERORDER);
+        uvmdealloc(pagetable, a, oldsz);
+        return 0;
+      }
+      a += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
     mem = kalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
@@ -298,49 +560,170 @@ freewalk(pagetable_t pagetable)
 void
 uvmfree(pagetable_t pagetable, uint64 sz)
 {
+  pagetable_t low;
+
   if(sz > 0)
     uvmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
+  // drop the kernel's device mappings; see uvmcreate().
+  low = (pagetable_t)PTE2PA(pagetable[0]);
+  for(int i = PX(1, USERTOP); i < 512; i++)
+    low[i] = 0;
   freewalk(pagetable);
 }
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// The physical memory is not copied: both page
+// tables refer to the same pages, and writable
+// pages become read-only copy-on-write pages in
+// both; see uvmcow(). The parent's superpages are
+// demoted, since pages are shared one at a time.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmcopyrange(old, new, 0, sz, 0);
+}
+
+// Like uvmcopy(), for the pages in [va, va+len), which
+// need not all be mapped. If shared, writable pages stay
+// writable in both page tables, for MAP_SHARED mappings.
+// va must be page-aligned.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 va, uint64 len, int shared)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = va; i < va + len; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+      continue;   // not allocated yet
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(*pte & PTE_S){
+      if(demote(pte) != 0)
+        goto err;
+      pte = walk(old, i, 0);
+    }
+    if((*pte & PTE_W) && !shared)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    flags = PTE_FLAGS(*pte) & ~PTE_D;
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    krefinc((void*)pa);
   }
+  uvmstale(old);
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, va, (i - va) / PGSIZE, 1);
+  uvmstale(old);
   return -1;
 }
 
-// mark a PTE invalid for user access.
+// Give the copy-on-write page at va its own writable
+// copy, or take it over in place if no other page
+// table refers to it any more.
+// Returns 0 on success, -1 if va is not a copy-on-write
+// page or memory cannot be allocated.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  if((pte = walk(pagetable, va, 0)) == 0)
+    return -1;
+  if((*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 || (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    uvmfresh(pagetable, va);
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  uvmfresh(pagetable, va);
+  kfree((void*)pa);
+  return 0;
+}
+
+// Handle a fault on user address va of the current process.
+// Memory between the program's data and p->sz is allocated
+// lazily: sbrk() only moves p->sz, and the first access maps
+// a zeroed page, or a zeroed superpage if the whole 2 MiB
+// around va is unmapped and below p->sz. Above p->sz, a
+// memory-mapped file's page is read in (see mmap.c). A
+// write to a copy-on-write page gets its own copy. read is
+// 1 if the access was a load.
+// Returns the physical address of the page at va, or 0 if
+// the access is not allowed or memory cannot be allocated.
+uint64
+vmfault(pagetable_t pagetable, uint64 va, int read)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  uint64 a;
+  char *mem;
+  int perm;
+
+  if(va >= MAXVA)
+    return 0;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(read || uvmcow(pagetable, va) != 0)
+      return 0;
+    return pteaddr(*pte, va);
+  }
+
+  if(p == 0 || p->pagetable != pagetable)
+    return 0;
+  if(va >= p->sz){
+    if((mem = mmappage(p, va, read, &perm)) == 0)
+      return 0;
+    if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+      kfree(mem);
+      return 0;
+    }
+    uvmfresh(pagetable, va);
+    return (uint64)mem;
+  }
+  a = SUPERPGROUNDDOWN(va);
+  if(a + SUPERPGSIZE <= p->sz && (pte = walklevel(pagetable, a, 1, 1)) != 0 &&
+     (*pte & PTE_V) == 0 && (mem = kalloc_order(SUPERORDER)) != 0){
+    memset(mem, 0, SUPERPGSIZE);
+    *pte = PA2PTE(mem) | PTE_R | PTE_W | PTE_U | PTE_S | PTE_V;
+    uvmfresh(pagetable, va);
+    return (uint64)mem + (va - a);
+  }
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return 0;
+  }
+  uvmfresh(pagetable, va);
+  return (uint64)mem;
+}
+
+// mark a PTE invalid for any access.
 // used by exec for the user stack guard page.
+// the PTE stays valid, so the page isn't allocated lazily,
+// but without R, W or X it is not a leaf and the hardware
+// faults on any access to it, from the kernel too.
 void
 uvmclear(pagetable_t pagetable, uint64 va)
 {
@@ -349,7 +732,50 @@ uvmclear(pagetable_t pagetable, uint64 va)
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  *pte &= ~(PTE_R|PTE_W|PTE_X);
+  uvmstale(pagetable);
+}
+
+// Fault in the pages of mapped files in [va, va+len) of the
+// current process, writable if write is set, before a copy
+// that happens under a lock: mmappage() mustn't read a file
+// then (see there). Pages below p->sz fault in without locks,
+// so they're left alone. A page that can't be mapped stops
+// this, and the copy fails on it as before.
+void
+uvmprefault(uint64 va, uint64 len, int write)
+{
+  struct proc *p = myproc();
+  uint64 a;
+  pte_t *pte;
+
+  if(va + len < va || va + len > MAXVA)
+    return;
+  a = PGROUNDDOWN(va);
+  if(a < PGROUNDDOWN(p->sz))
+    a = PGROUNDDOWN(p->sz);
+  for(; a < va + len; a += PGSIZE){
+    if(a < p->sz)
+      continue;
+    pte = walk(p->pagetable, a, 0);
+    if(pte && (*pte & PTE_V) && (!write || (*pte & PTE_W)))
+      continue;
+    if(vmfault(p->pagetable, a, !write) == 0)
+      break;
+  }
+}
+
+// Can the kernel copy len bytes at user address va of
+// pagetable directly? Only if it is the current process's,
+// whose kernel page table maps it, and only below p->sz;
+// the copy routines in usercopy.S take page faults on pages
+// that are lazy or copy-on-write, and return -1 for others.
+static int
+ucopyok(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+
+  return p && p->pagetable == pagetable && va + len >= va && va + len <= p->sz;
 }
 
 // Copy from kernel to user.
@@ -361,15 +787,23 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   uint64 n, va0, pa0;
   pte_t *pte;
 
+  if(ucopyok(pagetable, dstva, len))
+    return ucopy((void*)dstva, src, len);
+
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
     if(va0 >= MAXVA)
       return -1;
     pte = walk(pagetable, va0, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-       (*pte & PTE_W) == 0)
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_W) == 0){
+      if(vmfault(pagetable, va0, 0) == 0)
+        return -1;
+      pte = walk(pagetable, va0, 0);
+    }
+    if((*pte & PTE_U) == 0 || (*pte & PTE_W) == 0)
       return -1;
-    pa0 = PTE2PA(*pte);
+    *pte |= PTE_D;  // as a user store would, for mmap.c
+    pa0 = pteaddr(*pte, va0);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -390,10 +824,13 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(ucopyok(pagetable, srcva, len))
+    return ucopy(dst, (void*)srcva, len);
+
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, 1)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
@@ -416,11 +853,19 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
   int got_null = 0;
+  struct proc *p = myproc();
+
+  if(ucopyok(pagetable, srcva, 1)){
+    // a string that runs past p->sz fails either way.
+    if(max > p->sz - srcva)
+      max = p->sz - srcva;
+    return ucopystr(dst, (void*)srcva, max);
+  }
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, 1)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
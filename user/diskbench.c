@@ -0,0 +1,132 @@
+// Compare the latency of random 4K reads from the disk with
+// interrupt-driven and with polled completions (see iopoll()).
+//
+// Each read is a fault on a page of a memory-mapped file, which
+// reads the page's four blocks as one disk request. Before each
+// round, dropcaches() makes the kernel drop its cached copies
+// of the file.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+
+#define NPAGE   64    // pages in the file
+#define NROUND  8     // times each page is read, per mode
+#define PGSIZE  4096
+
+static char buf[PGSIZE];
+static uint64 lat[NPAGE*NROUND];
+static unsigned long rnd = 1;
+
+static uint64
+now(void)
+{
+  uint64 ns;
+
+  clock_gettime(&ns);
+  return ns;
+}
+
+static int
+random(int n)
+{
+  rnd = rnd * 1103515245 + 12345;
+  return (rnd >> 16) % n;
+}
+
+// sort lat[0..n-1], for the median.
+static void
+sort(uint64 *v, int n)
+{
+  for(int i = 1; i < n; i++){
+    uint64 x = v[i];
+    int j;
+    for(j = i; j > 0 && v[j-1] > x; j--)
+      v[j] = v[j-1];
+    v[j] = x;
+  }
+}
+
+// print t, in nanoseconds, as microseconds.
+static void
+pus(char *what, uint64 t)
+{
+  printf(" %s %d.%d", what, (int)(t/1000), (int)(t%1000/100));
+}
+
+static void
+bench(char *name, int fd, int poll)
+{
+  int order[NPAGE], n = 0;
+  uint64 sum = 0, t0;
+  char *p;
+
+  iopoll(poll);
+  for(int r = 0; r < NROUND; r++){
+    for(int i = 0; i < NPAGE; i++)
+      order[i] = i;
+    for(int i = NPAGE-1; i > 0; i--){
+      int j = random(i+1), t = order[i];
+      order[i] = order[j];
+      order[j] = t;
+    }
+
+    dropcaches();
+    p = mmap(0, NPAGE*PGSIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if(p == (char*)-1){
+      printf("diskbench: mmap failed\n");
+      exit(1);
+    }
+    for(int i = 0; i < NPAGE; i++){
+      t0 = now();
+      if(*(volatile char*)(p + order[i]*PGSIZE) != (char)order[i]){
+        printf("diskbench: wrong data in page %d\n", order[i]);
+        exit(1);
+      }
+      lat[n++] = now() - t0;
+    }
+    munmap(p, NPAGE*PGSIZE);
+  }
+  iopoll(0);
+
+  for(int i = 0; i < n; i++)
+    sum += lat[i];
+  sort(lat, n);
+  printf("%s:", name);
+  pus("avg", sum / n);
+  pus("median", lat[n/2]);
+  pus("min", lat[0]);
+  pus("max", lat[n-1]);
+  printf(" us\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *path = "diskbench.tmp";
+  int fd;
+
+  fd = open(path, O_CREATE | O_RDWR | O_TRUNC);
+  if(fd < 0){
+    printf("diskbench: cannot create %s\n", path);
+    exit(1);
+  }
+  for(int i = 0; i < NPAGE; i++){
+    memset(buf, i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("diskbench: write failed; is the disk full?\n");
+      unlink(path);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open(path, O_RDONLY);
+  printf("diskbench: %d random 4K reads per mode\n", NPAGE*NROUND);
+  bench("interrupt", fd, 0);
+  bench("poll", fd, 1);
+  close(fd);
+  unlink(path);
+  exit(0);
+}
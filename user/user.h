@@ -22,6 +22,12 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void* mmap(void*, uint, int, int, int, uint);
+int munmap(void*, uint);
+int iopoll(int);
+int clock_gettime(uint64*);
+int nanosleep(uint64);
+int dropcaches(void);
 
 // ulib.c
 int stat(const char*, struct stat*);
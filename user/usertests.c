@@ -1089,6 +1089,429 @@ mem(char *s)
   }
 }
 
+// fork() shares pages copy-on-write. Each process must see
+// only its own writes, whether they come from user code or
+// from the kernel's copyout().
+void
+cowfork(char *s)
+{
+  enum { N = 64 };
+  char *a;
+  int i, pid, xstatus, fds[2], done[2];
+
+  a = sbrk(N*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    a[i*PGSIZE] = i;
+
+  for(int round = 0; round < 3; round++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(i = 0; i < N; i++){
+        if(a[i*PGSIZE] != i){
+          printf("%s: child saw %d at page %d\n", s, a[i*PGSIZE], i);
+          exit(1);
+        }
+        a[i*PGSIZE] = -1;
+      }
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+    for(i = 0; i < N; i++){
+      if(a[i*PGSIZE] != i){
+        printf("%s: parent saw child's write at page %d\n", s, i);
+        exit(1);
+      }
+    }
+  }
+
+  if(pipe(fds) != 0 || pipe(done) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // wait for the parent's read() into the shared page.
+    char c;
+    if(read(done[0], &c, 1) != 1 || a[0] != 0){
+      printf("%s: child saw parent's read()\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+  if(write(fds[1], "x", 1) != 1 || read(fds[0], a, 1) != 1 || a[0] != 'x'){
+    printf("%s: read() into a shared page failed\n", s);
+    exit(1);
+  }
+  write(done[1], "x", 1);
+  wait(&xstatus);
+  exit(xstatus);
+}
+
+// sbrk() only reserves addresses; pages appear on first use,
+// whether the first use is a user access or a system call.
+void
+lazysbrk(char *s)
+{
+  enum { N = 1024 };
+  char *a;
+  int fds[2];
+
+  a = sbrk(N*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  if(a[(N/2)*PGSIZE] != 0){
+    printf("%s: new page not zero\n", s);
+    exit(1);
+  }
+  a[(N-1)*PGSIZE] = 'y';
+
+  // copyin() and copyout() on pages that were never touched.
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], a + 7*PGSIZE, 1) != 1 ||
+     read(fds[0], a + 9*PGSIZE, 1) != 1 || a[9*PGSIZE] != 0){
+    printf("%s: system call on a lazy page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  if(sbrk(-N*PGSIZE) != a + N*PGSIZE){
+    printf("%s: sbrk de-allocation failed\n", s);
+    exit(1);
+  }
+}
+
+// memory in 2 MiB-aligned chunks is mapped with superpages;
+// fork() and shrinking the heap must split them correctly.
+void
+superpg(char *s)
+{
+  char *a, *end;
+  uint64 top;
+  int i, pid, xstatus;
+
+  top = (uint64)sbrk(0);
+  if(sbrk(SUPERPGROUNDUP(top) - top + 2*SUPERPGSIZE) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  a = (char*)SUPERPGROUNDUP(top);
+  end = a + 2*SUPERPGSIZE;
+  for(i = 0; i < 2*SUPERPGSIZE; i += PGSIZE)
+    a[i] = i / PGSIZE;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < 2*SUPERPGSIZE; i += PGSIZE){
+      if(a[i] != (char)(i / PGSIZE))
+        exit(1);
+      a[i] = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong data\n", s);
+    exit(1);
+  }
+
+  // cut into the second superpage.
+  if(sbrk(-3*PGSIZE) != end){
+    printf("%s: sbrk de-allocation failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*SUPERPGSIZE - 3*PGSIZE; i += PGSIZE){
+    if(a[i] != (char)(i / PGSIZE)){
+      printf("%s: wrong data at %p\n", s, a + i);
+      exit(1);
+    }
+  }
+  if(sbrk(PGSIZE) == (char*)0xffffffffffffffffL || end[-3*PGSIZE] != 0){
+    printf("%s: re-allocated page not zero\n", s);
+    exit(1);
+  }
+}
+
+// mmap() a file: private mappings see its data and zeroes past
+// the end, writes to shared ones are seen by read() at once and
+// reach the disk at munmap() or exit().
+void
+mmaptest(char *s)
+{
+  enum { N = 3*PGSIZE };
+  char *f = "mmaptest.tmp";
+  char *a, *buf = (char*)malloc(N);
+  int fd, i, pid, xstatus;
+
+  unlink(f);
+  fd = open(f, O_CREATE|O_RDWR);
+  for(i = 0; i < N - PGSIZE/2; i++)
+    buf[i] = 'a' + i % 26;
+  if(fd < 0 || write(fd, buf, N - PGSIZE/2) != N - PGSIZE/2){
+    printf("%s: create %s failed\n", s, f);
+    exit(1);
+  }
+
+  a = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(a[i] != (i < N - PGSIZE/2 ? buf[i] : 0)){
+      printf("%s: wrong data at offset %d\n", s, i);
+      exit(1);
+    }
+  }
+  a[0] = 'X';
+  if(munmap(a, N) != 0){
+    printf("%s: munmap private failed\n", s);
+    exit(1);
+  }
+
+  a = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  a[0] = 'Y';
+
+  // the mapping shares the page cache with read().
+  i = open(f, O_RDONLY);
+  if(i < 0 || read(i, buf, 1) != 1 || buf[0] != 'Y'){
+    printf("%s: read() didn't see a shared write\n", s);
+    exit(1);
+  }
+  close(i);
+
+  if(munmap(a, PGSIZE) != 0){
+    printf("%s: munmap of first page failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a[2*PGSIZE] = 'Z';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(munmap(a + PGSIZE, 2*PGSIZE) != 0){
+    printf("%s: munmap of the rest failed\n", s);
+    exit(1);
+  }
+
+  close(fd);
+
+  fd = open(f, O_RDONLY);
+  if(read(fd, buf, N) != N - PGSIZE/2 || buf[0] != 'Y' || buf[2*PGSIZE] != 'Z'){
+    printf("%s: shared writes didn't reach the file\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(f);
+  free(buf);
+}
+
+// read(), write() and a pipe read to and from mapped pages
+// that haven't been touched yet, so that the copy itself
+// has to read in the file.
+void
+mmapiotest(char *s)
+{
+  enum { N = 2*PGSIZE };
+  char *f1 = "mmapio1.tmp", *f2 = "mmapio2.tmp";
+  char *a, *b, *buf = (char*)malloc(N);
+  int fd1, fd2, i, fds[2];
+
+  unlink(f1);
+  unlink(f2);
+  fd1 = open(f1, O_CREATE|O_RDWR);
+  fd2 = open(f2, O_CREATE|O_RDWR);
+  for(i = 0; i < N; i++)
+    buf[i] = 'a' + i % 26;
+  if(fd1 < 0 || fd2 < 0 || write(fd1, buf, N) != N){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd1);
+  fd1 = open(f1, O_RDWR);
+
+  // copy f1 to f2 through a mapping of f1.
+  a = mmap(0, N, PROT_READ, MAP_SHARED, fd1, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(write(fd2, a, N) != N){
+    printf("%s: write() from a mapping failed\n", s);
+    exit(1);
+  }
+
+  close(fd2);
+  fd2 = open(f2, O_RDWR);
+  if(read(fd2, buf, N) != N || memcmp(buf, a, N) != 0){
+    printf("%s: write() from a mapping wrote the wrong data\n", s);
+    exit(1);
+  }
+
+  // read f1 again into a mapping of f2.
+  b = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd2, 0);
+  if(b == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(read(fd1, b, N) != N){
+    printf("%s: read() into a mapping failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(b[i] != a[i]){
+      printf("%s: wrong data at offset %d\n", s, i);
+      exit(1);
+    }
+  }
+  munmap(b, N);
+
+  // a pipe read into a mapping loses nothing.
+  b = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd2, 0);
+  if(b == (char*)0xffffffffffffffffL || pipe(fds) != 0){
+    printf("%s: mmap or pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "hello", 5) != 5 || read(fds[0], b + PGSIZE, 5) != 5 ||
+     memcmp(b + PGSIZE, "hello", 5) != 0){
+    printf("%s: pipe read into a mapping failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  munmap(a, N);
+  munmap(b, N);
+  close(fd1);
+  close(fd2);
+  unlink(f1);
+  unlink(f2);
+  free(buf);
+}
+
+// file I/O from several processes while the disk driver
+// polls for completions.
+void
+iopolltest(char *s)
+{
+  enum { NCHILD = 3, NB = 20 };
+  char name[] = "iopoll0";
+  char buf[BSIZE];
+  int fd, i, j, old, xstatus;
+
+  old = iopoll(1);
+  for(i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      name[6] = '0' + i;
+      fd = open(name, O_CREATE|O_RDWR|O_TRUNC);
+      if(fd < 0){
+        printf("%s: create %s failed\n", s, name);
+        exit(1);
+      }
+      for(j = 0; j < NB; j++){
+        memset(buf, 'a' + i + j, sizeof(buf));
+        if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+          printf("%s: write %s failed\n", s, name);
+          exit(1);
+        }
+      }
+      close(fd);
+      fd = open(name, O_RDONLY);
+      for(j = 0; j < NB; j++){
+        if(read(fd, buf, sizeof(buf)) != sizeof(buf) ||
+           buf[0] != 'a' + i + j || buf[BSIZE-1] != 'a' + i + j){
+          printf("%s: wrong data in %s\n", s, name);
+          exit(1);
+        }
+      }
+      close(fd);
+      unlink(name);
+      exit(0);
+    }
+  }
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      iopoll(old);
+      exit(xstatus);
+    }
+  }
+  iopoll(old);
+}
+
+// a nanosleep() shorter than a clock tick should take at
+// least as long as asked, by clock_gettime().
+void
+nanosleeptest(char *s)
+{
+  uint64 t0, t1, prev;
+  int i;
+
+  if(clock_gettime(&t0) < 0){
+    printf("%s: clock_gettime failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 5; i++){
+    if(nanosleep(2000000) < 0){
+      printf("%s: nanosleep failed\n", s);
+      exit(1);
+    }
+  }
+  clock_gettime(&t1);
+  if(t1 - t0 < 5*2000000){
+    printf("%s: 5 nanosleep(2 ms) took %d us\n", s, (int)((t1 - t0) / 1000));
+    exit(1);
+  }
+
+  // the clock doesn't go backwards.
+  prev = t1;
+  for(i = 0; i < 100; i++){
+    clock_gettime(&t1);
+    if(t1 < prev){
+      printf("%s: clock went backwards\n", s);
+      exit(1);
+    }
+    prev = t1;
+  }
+}
+
 // More file system tests
 
 // two processes write to the same file descriptor
@@ -2429,6 +2852,29 @@ stacktest(char *s)
     exit(xstatus);
 }
 
+// system calls must not be able to use the stack guard
+// page either.
+void
+guardcopy(char *s)
+{
+  char *guard = (char *) r_sp() - USERSTACK*PGSIZE;
+  int fds[2];
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], guard, 1) > 0){
+    printf("%s: write() from the guard page succeeded\n", s);
+    exit(1);
+  }
+  write(fds[1], "x", 1);
+  if(read(fds[0], guard, 1) > 0){
+    printf("%s: read() into the guard page succeeded\n", s);
+    exit(1);
+  }
+}
+
 // check that writes to a few forbidden addresses
 // cause a fault, e.g. process's text and TRAMPOLINE.
 void
@@ -2618,6 +3064,13 @@ struct test {
   {forkforkfork, "forkforkfork"},
   {reparent2, "reparent2"},
   {mem, "mem"},
+  {cowfork, "cowfork"},
+  {lazysbrk, "lazysbrk"},
+  {superpg, "superpg"},
+  {mmaptest, "mmaptest"},
+  {mmapiotest, "mmapiotest"},
+  {iopolltest, "iopolltest"},
+  {nanosleeptest, "nanosleeptest"},
   {sharedfd, "sharedfd"},
   {fourfiles, "fourfiles"},
   {createdelete, "createdelete"},
@@ -2644,6 +3097,7 @@ struct test {
   {bigargtest, "bigargtest"},
   {argptest, "argptest"},
   {stacktest, "stacktest"},
+  {guardcopy, "guardcopy"},
   {nowrite, "nowrite"},
   {pgbug, "pgbug" },
   {sbrkbugs, "sbrkbugs" },
@@ -36,3 +36,9 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("mmap");
+entry("munmap");
+entry("iopoll");
+entry("clock_gettime");
+entry("nanosleep");
+entry("dropcaches");